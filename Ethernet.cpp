@@ -6,6 +6,7 @@
 #include "Ethernet.h"
 #include "Dhcp.h"
 #include "util.h"
+#include "socket.h"
 
 // XXX: don't make assumptions about the value of MAX_SOCK_NUM.
 uint8_t EthernetClass::_state[MAX_SOCK_NUM] = { 
@@ -21,10 +22,10 @@ int EthernetClass::begin(uint8_t *mac_address)
 
   // Initialise the basic info
   Wiznet.init();
-  SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+  WiznetBus::begin();
   Wiznet.setMACAddress(mac_address);
   Wiznet.setIPAddress(IPAddress(0,0,0,0).raw_address());
-  SPI.endTransaction();
+  WiznetBus::end();
 
   // Now try to get our config info from a DHCP server
   int ret = _dhcp->beginWithDHCP(mac_address);
@@ -32,11 +33,11 @@ int EthernetClass::begin(uint8_t *mac_address)
   {
     // We've successfully found a DHCP server and got our configuration info, so set things
     // accordingly
-    SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+    WiznetBus::begin();
     Wiznet.setIPAddress(_dhcp->getLocalIp().raw_address());
     Wiznet.setGatewayIp(_dhcp->getGatewayIp().raw_address());
     Wiznet.setSubnetMask(_dhcp->getSubnetMask().raw_address());
-    SPI.endTransaction();
+    WiznetBus::end();
     _dnsServerAddress = _dhcp->getDnsServerIp();
   }
 
@@ -70,12 +71,12 @@ void EthernetClass::begin(uint8_t *mac_address, IPAddress local_ip, IPAddress dn
 void EthernetClass::begin(uint8_t *mac, IPAddress local_ip, IPAddress dns_server, IPAddress gateway, IPAddress subnet)
 {
   Wiznet.init();
-  SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+  WiznetBus::begin();
   Wiznet.setMACAddress(mac);
   Wiznet.setIPAddress(local_ip._address);
   Wiznet.setGatewayIp(gateway._address);
   Wiznet.setSubnetMask(subnet._address);
-  SPI.endTransaction();
+  WiznetBus::end();
   _dnsServerAddress = dns_server;
 }
 
@@ -88,10 +89,10 @@ int EthernetClass::begin(void)
 
   // Initialise the basic info
   Wiznet.init();
-  SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+  WiznetBus::begin();
   Wiznet.setIPAddress(IPAddress(0,0,0,0).raw_address());
   Wiznet.getMACAddress(mac_address);
-  SPI.endTransaction();
+  WiznetBus::end();
 
   WIZNET_DEBUG("MAC Address: ");
   WIZNET_DEBUG(mac_address[0], HEX);
@@ -117,11 +118,11 @@ int EthernetClass::begin(void)
   {
     // We've successfully found a DHCP server and got our configuration info, so set things
     // accordingly
-    SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+    WiznetBus::begin();
     Wiznet.setIPAddress(_dhcp->getLocalIp().raw_address());
     Wiznet.setGatewayIp(_dhcp->getGatewayIp().raw_address());
     Wiznet.setSubnetMask(_dhcp->getSubnetMask().raw_address());
-    SPI.endTransaction();
+    WiznetBus::end();
     _dnsServerAddress = _dhcp->getDnsServerIp();
   }
 
@@ -154,12 +155,12 @@ void EthernetClass::begin(IPAddress local_ip, IPAddress dns_server, IPAddress ga
 
 void EthernetClass::begin(IPAddress local_ip, IPAddress dns_server, IPAddress gateway, IPAddress subnet)
 {
-  SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+  WiznetBus::begin();
   Wiznet.init();
   Wiznet.setIPAddress(local_ip._address);
   Wiznet.setGatewayIp(gateway._address);
   Wiznet.setSubnetMask(subnet._address);
-  SPI.endTransaction();
+  WiznetBus::end();
   _dnsServerAddress = dns_server;
 }
 #endif
@@ -176,11 +177,11 @@ int EthernetClass::maintain(){
       case DHCP_CHECK_RENEW_OK:
       case DHCP_CHECK_REBIND_OK:
         //we might have got a new IP.
-        SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+        WiznetBus::begin();
         Wiznet.setIPAddress(_dhcp->getLocalIp().raw_address());
         Wiznet.setGatewayIp(_dhcp->getGatewayIp().raw_address());
         Wiznet.setSubnetMask(_dhcp->getSubnetMask().raw_address());
-        SPI.endTransaction();
+        WiznetBus::end();
         _dnsServerAddress = _dhcp->getDnsServerIp();
         break;
       default:
@@ -191,30 +192,127 @@ int EthernetClass::maintain(){
   return rc;
 }
 
+int EthernetClass::setBufferSizes(const uint8_t *txKB, const uint8_t *rxKB)
+{
+  return Wiznet.setBufferSizes(txKB, rxKB);
+}
+
+int EthernetClass::setSocketBufferSize(uint8_t sock, uint8_t txKB, uint8_t rxKB)
+{
+  if (sock >= MAX_SOCK_NUM)
+    return 0;
+
+  WiznetBus::begin();
+  int ret = Wiznet.setSocketBufferSize(sock, txKB, rxKB);
+  WiznetBus::end();
+  return ret;
+}
+
+int EthernetClass::enableInterrupts(uint8_t pin)
+{
+  return socketEventsBegin(pin);
+}
+
+void EthernetClass::disableInterrupts()
+{
+  socketEventsEnd();
+}
+
+// Sn_DIPR of the last socket is scratch space while that socket is closed
+static uint8_t spiReadBack(uint32_t hz)
+{
+  static const uint8_t patterns[][4] = {
+    { 0x55, 0xAA, 0x55, 0xAA },
+    { 0xFF, 0x00, 0xFF, 0x00 },
+    { 0x01, 0x02, 0x04, 0x08 },
+    { 0xFE, 0xFD, 0xFB, 0xF7 },
+  };
+  uint8_t buf[4];
+  uint8_t ok = 1;
+
+  WiznetClock::set(hz);
+  WiznetBus::begin();
+  for (uint8_t round = 0; round < 8 && ok; round++) {
+    for (uint8_t i = 0; i < sizeof(patterns) / sizeof(patterns[0]) && ok; i++) {
+      Wiznet.writeSnDIPR(MAX_SOCK_NUM - 1, (uint8_t *)patterns[i]);
+      Wiznet.readSnDIPR(MAX_SOCK_NUM - 1, buf);
+      ok = memcmp(buf, patterns[i], sizeof(buf)) == 0;
+    }
+  }
+  WiznetBus::end();
+  return ok;
+}
+
+uint32_t EthernetClass::tuneSPIClock()
+{
+  static const uint32_t steps[] = {
+    4000000, 8000000, 14000000, 20000000, 28000000, 40000000, 56000000, 80000000
+  };
+  uint32_t start = WiznetClock::rate;
+  uint32_t best = 0;
+  uint8_t saved[4];
+
+  WiznetBus::begin();
+  Wiznet.readSnDIPR(MAX_SOCK_NUM - 1, saved);
+  WiznetBus::end();
+
+  // The steps below the chip's ceiling, the ceiling itself, and the clock
+  // we started at, in order, so tuning can't settle below where it began
+  // for want of a step there
+  const uint8_t count = sizeof(steps) / sizeof(steps[0]);
+  uint32_t rates[count + 2];
+  uint8_t n = 0;
+  uint8_t startAdded = 0;
+  for (uint8_t i = 0; i <= count; i++) {
+    uint32_t rate = i < count ? steps[i] : WIZNET_SPI_MAX_CLOCK;
+    if (i < count && rate >= WIZNET_SPI_MAX_CLOCK)
+      continue;
+    if (!startAdded && start <= rate) {
+      if (start < rate)
+        rates[n++] = start;
+      startAdded = 1;
+    }
+    rates[n++] = rate;
+  }
+
+  for (uint8_t i = 0; i < n; i++) {
+    if (!spiReadBack(rates[i]))
+      break;
+    best = rates[i];
+  }
+  // Nothing passed: the bus is in trouble at any speed, so leave it alone
+  WiznetClock::set(best ? best : start);
+
+  WiznetBus::begin();
+  Wiznet.writeSnDIPR(MAX_SOCK_NUM - 1, saved);
+  WiznetBus::end();
+  return WiznetClock::rate;
+}
+
 IPAddress EthernetClass::localIP()
 {
   IPAddress ret;
-  SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+  WiznetBus::begin();
   Wiznet.getIPAddress(ret.raw_address());
-  SPI.endTransaction();
+  WiznetBus::end();
   return ret;
 }
 
 IPAddress EthernetClass::subnetMask()
 {
   IPAddress ret;
-  SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+  WiznetBus::begin();
   Wiznet.getSubnetMask(ret.raw_address());
-  SPI.endTransaction();
+  WiznetBus::end();
   return ret;
 }
 
 IPAddress EthernetClass::gatewayIP()
 {
   IPAddress ret;
-  SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+  WiznetBus::begin();
   Wiznet.getGatewayIp(ret.raw_address());
-  SPI.endTransaction();
+  WiznetBus::end();
   return ret;
 }
 
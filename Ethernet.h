@@ -42,6 +42,28 @@ public:
   
   int maintain();
 
+  // Split the chip's buffer memory between the sockets. txKB and rxKB hold one
+  // size in KB per socket (MAX_SOCK_NUM entries). Call before begin().
+  // Returns 1 if the layout fits the chip, else 0
+  static int setBufferSizes(const uint8_t *txKB, const uint8_t *rxKB);
+  // Resize the buffers of a closed socket. The sockets numbered above it are
+  // moved by the chip, so they have to be closed as well.
+  // Returns 1 on success, else 0
+  static int setSocketBufferSize(uint8_t sock, uint8_t txKB, uint8_t rxKB);
+  // Use the chip's INTn line, wired to pin, to learn about socket events
+  // instead of polling the status registers of every socket.
+  // Returns 1 on success, else 0
+  static int enableInterrupts(uint8_t pin);
+  static void disableInterrupts();
+
+  // Step the SPI clock up to WIZNET_SPI_MAX_CLOCK, checking each rate by
+  // writing test patterns to a closed socket's registers and reading them
+  // back, and keep the fastest rate that passed. Call after begin(), before
+  // any socket is opened.
+  // Returns the SPI clock now in use, in Hz
+  static uint32_t tuneSPIClock();
+  static uint32_t spiClock() { return WiznetClock::rate; }
+
   IPAddress localIP();
   IPAddress subnetMask();
   IPAddress gatewayIP();
@@ -0,0 +1,276 @@
+#include "wiznet.h"
+#include "socket.h"
+#include "Ethernet.h"
+#include "EthernetCapture.h"
+
+// MACRAW is only available on socket 0
+#define CAPTURE_SOCKET 0
+
+// Bytes read from the front of each frame to run the filter on: the chip's
+// length field, the Ethernet header, an IPv4 header without options and the
+// TCP or UDP ports
+#define CAPTURE_HEAD_SIZE (2 + 14 + 20 + 4)
+
+// Each record in the buffer: seconds, microseconds, bytes kept and frame
+// length, followed by the bytes kept
+#define CAPTURE_RECORD_SIZE 12
+
+#define MATCH_TYPE  0x01
+#define MATCH_HOST  0x02
+#define MATCH_PROTO 0x04
+#define MATCH_PORT  0x08
+
+#define ETHERTYPE_IPV4 0x0800
+
+static void putLE16(uint8_t *p, uint16_t v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+}
+
+static void putLE32(uint8_t *p, uint32_t v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+EthernetCapture::EthernetCapture(uint8_t *buffer, uint16_t size)
+  : _buf(buffer), _size(size), _head(0), _tail(0), _end(0), _wrapped(0), _count(0),
+    _match(0), _snaplen(ETHERNET_CAPTURE_SNAPLEN), _sec(0), _usec(0), _lastMicros(0),
+    _captured(0)
+{
+}
+
+uint8_t EthernetCapture::begin()
+{
+  if (socketStatus(CAPTURE_SOCKET) != SnSR::CLOSED)
+    return 0;
+
+  EthernetClass::_server_port[CAPTURE_SOCKET] = 0;
+  _head = _tail = _end = 0;
+  _wrapped = 0;
+  _count = 0;
+  _captured = 0;
+  _sec = _usec = 0;
+  _lastMicros = micros();
+  return socket(CAPTURE_SOCKET, SnMR::MACRAW, 0, 0);
+}
+
+void EthernetCapture::end()
+{
+  close(CAPTURE_SOCKET);
+}
+
+void EthernetCapture::setFilter(uint16_t ethertype, IPAddress host, uint8_t protocol, uint16_t port)
+{
+  _match = 0;
+  _ethertype = ethertype;
+  for (int i = 0; i < 4; i++)
+    _host[i] = host[i];
+  _protocol = protocol;
+  _port = port;
+
+  // Work out once which tests a frame has to pass
+  if (_host[0] || _host[1] || _host[2] || _host[3])
+    _match |= MATCH_HOST;
+  if (protocol)
+    _match |= MATCH_PROTO;
+  if (port)
+    _match |= MATCH_PORT;
+  if (_match)
+    _ethertype = ETHERTYPE_IPV4;
+  if (_ethertype)
+    _match |= MATCH_TYPE;
+}
+
+void EthernetCapture::clearFilter()
+{
+  _match = 0;
+}
+
+void EthernetCapture::setSnapLength(uint16_t snaplen)
+{
+  _snaplen = snaplen;
+}
+
+void EthernetCapture::setTime(uint32_t seconds)
+{
+  tick();
+  _sec = seconds;
+}
+
+// Bring the clock up to now. Frames are stamped when poll() takes them from
+// the chip, which can be a little after they arrived.
+void EthernetCapture::tick()
+{
+  unsigned long now = micros();
+  uint32_t elapsed = now - _lastMicros;
+  _lastMicros = now;
+
+  _sec += elapsed / 1000000UL;
+  _usec += elapsed % 1000000UL;
+  if (_usec >= 1000000UL) {
+    _usec -= 1000000UL;
+    _sec++;
+  }
+}
+
+// frame holds the first len bytes of the current frame
+uint8_t EthernetCapture::matches(const uint8_t *frame, uint16_t len)
+{
+  if (!_match)
+    return 1;
+  if (len < 14)
+    return 0;
+  if ((_match & MATCH_TYPE) && ((frame[12] << 8) | frame[13]) != _ethertype)
+    return 0;
+  if (!(_match & (MATCH_HOST | MATCH_PROTO | MATCH_PORT)))
+    return 1;
+
+  const uint8_t *ip = frame + 14;
+  if (len < 14 + 20 || (ip[0] >> 4) != 4)
+    return 0;
+  if ((_match & MATCH_HOST) && memcmp(ip + 12, _host, 4) != 0 && memcmp(ip + 16, _host, 4) != 0)
+    return 0;
+  if ((_match & MATCH_PROTO) && ip[9] != _protocol)
+    return 0;
+  if (_match & MATCH_PORT) {
+    // Only the first fragment carries the ports
+    if ((ip[9] != IPPROTO::TCP && ip[9] != IPPROTO::UDP) || (ip[6] & 0x1F) || ip[7])
+      return 0;
+
+    uint8_t ports[4];
+    uint16_t at = 14 + (ip[0] & 0x0F) * 4;
+    if (at + 4 <= len)
+      memcpy(ports, frame + at, 4);
+    else if (recvFrameRead(CAPTURE_SOCKET, at, ports, 4) != 4)
+      return 0;
+    if (((ports[0] << 8) | ports[1]) != _port && ((ports[2] << 8) | ports[3]) != _port)
+      return 0;
+  }
+  return 1;
+}
+
+// Claim len contiguous bytes for a new record, or NULL if the buffer is full
+uint8_t *EthernetCapture::reserve(uint16_t len)
+{
+  if (_count == 0) {
+    _head = _tail = 0;
+    _wrapped = 0;
+  }
+
+  uint16_t at;
+  if (_wrapped) {
+    if (_tail - _head < len)
+      return NULL;
+    at = _head;
+  }
+  else if (_size - _head >= len) {
+    at = _head;
+  }
+  else if (_tail >= len) {
+    _end = _head;
+    _wrapped = 1;
+    at = 0;
+  }
+  else {
+    return NULL;
+  }
+
+  _head = at + len;
+  _count++;
+  return _buf + at;
+}
+
+int EthernetCapture::poll()
+{
+  uint8_t head[CAPTURE_HEAD_SIZE];
+  uint16_t len;
+  uint8_t full = 0;
+  int n = 0;
+
+  // One bus session for the whole pass
+  WiznetBus bus;
+  while ((len = recvFrameNext(CAPTURE_SOCKET, head, sizeof(head))) != 0) {
+    uint16_t got = len < sizeof(head) - 2 ? len : sizeof(head) - 2;
+    if (!matches(head + 2, got))
+      continue;
+
+    uint16_t keep = len < _snaplen ? len : _snaplen;
+    if (keep > _size - CAPTURE_RECORD_SIZE)
+      keep = _size - CAPTURE_RECORD_SIZE;
+    uint8_t *rec = reserve(CAPTURE_RECORD_SIZE + keep);
+    if (rec == NULL) {
+      // Leave this frame and the rest queued on the chip until dump() makes room
+      full = 1;
+      break;
+    }
+
+    tick();
+    memcpy(rec, &_sec, 4);
+    memcpy(rec + 4, &_usec, 4);
+    memcpy(rec + 8, &keep, 2);
+    memcpy(rec + 10, &len, 2);
+    uint8_t *data = rec + CAPTURE_RECORD_SIZE;
+    memcpy(data, head + 2, got < keep ? got : keep);
+    if (keep > got)
+      recvFrameRead(CAPTURE_SOCKET, got, data + got, keep - got);
+
+    _captured++;
+    n++;
+  }
+  recvFramesEnd(CAPTURE_SOCKET, full);
+  return n;
+}
+
+size_t EthernetCapture::writeHeader(Print &out)
+{
+  uint8_t hdr[24];
+  putLE32(hdr, 0xA1B2C3D4);  // Magic, microsecond timestamps
+  putLE16(hdr + 4, 2);       // Version 2.4
+  putLE16(hdr + 6, 4);
+  putLE32(hdr + 8, 0);       // Timestamps are UTC
+  putLE32(hdr + 12, 0);
+  putLE32(hdr + 16, _snaplen);
+  putLE32(hdr + 20, 1);      // LINKTYPE_ETHERNET
+  return out.write(hdr, sizeof(hdr));
+}
+
+uint16_t EthernetCapture::dump(Print &out, uint16_t maxBytes)
+{
+  uint16_t n = 0;
+  uint32_t written = 0;
+
+  while (_count > 0) {
+    uint8_t *rec = _buf + _tail;
+    uint32_t sec, usec;
+    uint16_t keep, len;
+    memcpy(&sec, rec, 4);
+    memcpy(&usec, rec + 4, 4);
+    memcpy(&keep, rec + 8, 2);
+    memcpy(&len, rec + 10, 2);
+
+    if (n > 0 && written + 16 + keep > maxBytes)
+      break;
+
+    uint8_t hdr[16];
+    putLE32(hdr, sec);
+    putLE32(hdr + 4, usec);
+    putLE32(hdr + 8, keep);
+    putLE32(hdr + 12, len);
+    out.write(hdr, sizeof(hdr));
+    out.write(rec + CAPTURE_RECORD_SIZE, keep);
+    written += 16 + keep;
+    n++;
+
+    _tail += CAPTURE_RECORD_SIZE + keep;
+    _count--;
+    if (_wrapped && _tail == _end) {
+      _tail = 0;
+      _wrapped = 0;
+    }
+  }
+  return n;
+}
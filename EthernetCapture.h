@@ -0,0 +1,92 @@
+#ifndef ethernetcapture_h
+#define ethernetcapture_h
+
+#include "Arduino.h"
+#include "Print.h"
+#include "IPAddress.h"
+
+// Most bytes kept of each captured frame, unless setSnapLength() says otherwise
+#ifndef ETHERNET_CAPTURE_SNAPLEN
+#if defined(__AVR__)
+#define ETHERNET_CAPTURE_SNAPLEN 96
+#else
+#define ETHERNET_CAPTURE_SNAPLEN 1514
+#endif
+#endif
+
+/*
+Captures the frames the chip sees, using socket 0 in MACRAW mode.
+
+poll() drains every queued frame in one pass, drops those the filter turns
+away after reading only their headers, and stores the rest, timestamped,
+in a ring buffer the sketch provides. dump() takes stored frames out again
+as pcap records, to any Print: Serial, a client, or a UDP packet:
+
+  udp.beginPacket(host, port);
+  capture.dump(udp, 1024);
+  udp.endPacket();
+
+Send the output of writeHeader() first.
+*/
+class EthernetCapture {
+public:
+  EthernetCapture(uint8_t *buffer, uint16_t size);
+
+  // Open socket 0 in MACRAW mode. Returns 1 if successful, 0 if socket 0 is in use
+  uint8_t begin();
+  void end();
+
+  // Keep only frames of this ethertype, to or from host, carrying protocol,
+  // to or from port. A 0 (or 0.0.0.0) matches anything; naming a host,
+  // protocol or port implies IPv4, and a port alone matches TCP or UDP
+  void setFilter(uint16_t ethertype, IPAddress host = IPAddress(0, 0, 0, 0), uint8_t protocol = 0, uint16_t port = 0);
+  void clearFilter();
+  void setSnapLength(uint16_t snaplen);
+  // Stamp frames from this many seconds since 1970 on, rather than from begin()
+  void setTime(uint32_t seconds);
+
+  // Move queued frames from the chip into the buffer.
+  // Returns the number stored
+  int poll();
+  // Number of frames stored and not yet dumped
+  uint16_t available() { return _count; };
+
+  // Write the pcap file header
+  size_t writeHeader(Print &out);
+  // Write stored frames to out as pcap records, oldest first, stopping before
+  // one that would take the output past maxBytes (the first is written anyway).
+  // Returns the number of records written
+  uint16_t dump(Print &out, uint16_t maxBytes = 0xFFFF);
+
+  // Frames stored since begin(). While the buffer is full, frames wait on
+  // the chip, and only those its own buffer has no room for are lost
+  uint32_t captured() { return _captured; };
+
+private:
+  uint8_t *_buf;
+  uint16_t _size;
+  uint16_t _head;    // Where the next record goes
+  uint16_t _tail;    // Oldest record
+  uint16_t _end;     // End of the records before _head wrapped to 0
+  uint8_t _wrapped;
+  uint16_t _count;
+
+  uint8_t _match;    // Filter terms in use
+  uint16_t _ethertype;
+  uint8_t _host[4];
+  uint8_t _protocol;
+  uint16_t _port;
+  uint16_t _snaplen;
+
+  uint32_t _sec;
+  uint32_t _usec;
+  unsigned long _lastMicros;
+
+  uint32_t _captured;
+
+  uint8_t matches(const uint8_t *frame, uint16_t len);
+  uint8_t *reserve(uint16_t len);
+  void tick();
+};
+
+#endif
@@ -14,10 +14,29 @@ extern "C" {
 
 uint16_t EthernetClient::_srcport = 1024;
 
-EthernetClient::EthernetClient() : _sock(MAX_SOCK_NUM) {
+#if ETHERNET_TX_COMBINE_SIZE > 0
+// Write combining state is kept per socket, as clients are copied around
+static uint8_t tx_buf[MAX_SOCK_NUM][ETHERNET_TX_COMBINE_SIZE];
+static uint16_t tx_len[MAX_SOCK_NUM];
+static unsigned long tx_since[MAX_SOCK_NUM]; // millis() of the oldest byte held
+static uint8_t tx_combine; // bit per socket
+#endif
+
+#if ETHERNET_RX_READAHEAD_SIZE > 0
+static uint8_t rx_buf[MAX_SOCK_NUM][ETHERNET_RX_READAHEAD_SIZE];
+static uint16_t rx_pos[MAX_SOCK_NUM];
+static uint16_t rx_len[MAX_SOCK_NUM];
+#endif
+
+// Connection attempts under way, per socket like the buffers
+static unsigned long conn_start[MAX_SOCK_NUM];
+static uint16_t conn_timeout[MAX_SOCK_NUM];
+static uint8_t connecting; // bit per socket
+
+EthernetClient::EthernetClient() : _sock(MAX_SOCK_NUM), _timeout(ETHERNET_CONNECT_TIMEOUT_MS) {
 }
 
-EthernetClient::EthernetClient(uint8_t sock) : _sock(sock) {
+EthernetClient::EthernetClient(uint8_t sock) : _sock(sock), _timeout(ETHERNET_CONNECT_TIMEOUT_MS) {
 }
 
 int EthernetClient::connect(const char* host, uint16_t port) {
@@ -36,11 +55,24 @@ int EthernetClient::connect(const char* host, uint16_t port) {
 }
 
 int EthernetClient::connect(IPAddress ip, uint16_t port) {
+  if (!connectAsync(ip, port))
+    return 0;
+
+  int8_t ret;
+  while ((ret = finishConnect()) == ETHERNET_CONNECT_BUSY)
+    delay(1);
+  return ret == ETHERNET_CONNECT_DONE;
+}
+
+int EthernetClient::connectAsync(IPAddress ip, uint16_t port) {
   if (_sock != MAX_SOCK_NUM)
     return 0;
 
+  SocketSnapshot snap[MAX_SOCK_NUM];
+  socketSnapshot(snap);
+
   for (int i = 0; i < MAX_SOCK_NUM; i++) {
-    uint8_t s = socketStatus(i);
+    uint8_t s = snap[i].sr;
     if (s == SnSR::CLOSED || s == SnSR::FIN_WAIT || s == SnSR::CLOSE_WAIT) {
       _sock = i;
       break;
@@ -50,24 +82,59 @@ int EthernetClient::connect(IPAddress ip, uint16_t port) {
   if (_sock == MAX_SOCK_NUM)
     return 0;
 
+  // A server may still be holding this one for disconnected(); it's ours now
+  EthernetClass::_server_port[_sock] = 0;
+  resetSocket(_sock);
+
   _srcport++;
   if (_srcport == 0) _srcport = 1024;
-  socket(_sock, SnMR::TCP, _srcport, 0);
+  if (!socket(_sock, SnMR::TCP, _srcport, 0)) {
+    _sock = MAX_SOCK_NUM;
+    return 0;
+  }
 
-  if (!::connect(_sock, rawIPAddress(ip), port)) {
+  if (!::connectAsync(_sock, rawIPAddress(ip), port)) {
+    close(_sock);
     _sock = MAX_SOCK_NUM;
     return 0;
   }
 
-  while (status() != SnSR::ESTABLISHED) {
-    delay(1);
-    if (status() == SnSR::CLOSED) {
+  conn_start[_sock] = millis();
+  conn_timeout[_sock] = _timeout;
+  connecting |= (1 << _sock);
+  return 1;
+}
+
+int8_t EthernetClient::connectState() {
+  if (_sock == MAX_SOCK_NUM)
+    return ETHERNET_CONNECT_FAILED;
+
+  uint8_t s = status();
+  if (s == SnSR::ESTABLISHED || s == SnSR::CLOSE_WAIT) {
+    connecting &= ~(1 << _sock);
+    return ETHERNET_CONNECT_DONE;
+  }
+  if (!(connecting & (1 << _sock)) || s == SnSR::CLOSED)
+    return ETHERNET_CONNECT_FAILED;
+  if (millis() - conn_start[_sock] >= conn_timeout[_sock])
+    return ETHERNET_CONNECT_TIMEOUT;
+  return ETHERNET_CONNECT_BUSY;
+}
+
+int8_t EthernetClient::finishConnect() {
+  int8_t ret = connectState();
+  if (ret == ETHERNET_CONNECT_TIMEOUT || ret == ETHERNET_CONNECT_FAILED) {
+    if (_sock != MAX_SOCK_NUM) {
+      connecting &= ~(1 << _sock);
+      close(_sock);
       _sock = MAX_SOCK_NUM;
-      return 0;
     }
   }
+  return ret;
+}
 
-  return 1;
+void EthernetClient::setConnectionTimeout(uint16_t ms) {
+  _timeout = ms;
 }
 
 size_t EthernetClient::write(uint8_t b) {
@@ -79,20 +146,149 @@ size_t EthernetClient::write(const uint8_t *buf, size_t size) {
     setWriteError();
     return 0;
   }
-  if (!send(_sock, buf, size)) {
+#if ETHERNET_TX_COMBINE_SIZE > 0
+  if (tx_combine & (1 << _sock)) {
+    commitIfIdle();
+    if (tx_len[_sock] + size > ETHERNET_TX_COMBINE_SIZE && !commitWrites())
+      return 0;
+    if (size < ETHERNET_TX_COMBINE_SIZE) {
+      if (tx_len[_sock] == 0)
+        tx_since[_sock] = millis();
+      memcpy(&tx_buf[_sock][tx_len[_sock]], buf, size);
+      tx_len[_sock] += size;
+      if (tx_len[_sock] == ETHERNET_TX_COMBINE_SIZE && !commitWrites())
+        return 0;
+      return size;
+    }
+  }
+#endif
+  size_t n = 0;
+  // send() takes at most 64K at a time, and less if the connection drops
+  while (n < size) {
+    uint16_t chunk = size - n > 0xFFFF ? 0xFFFF : size - n;
+    uint16_t sent = send(_sock, buf + n, chunk);
+    n += sent;
+    if (sent < chunk) {
+      setWriteError();
+      break;
+    }
+  }
+  return n;
+}
+
+int EthernetClient::availableForWrite() {
+  if (_sock == MAX_SOCK_NUM)
+    return 0;
+  int n = sendAvailable(_sock);
+#if ETHERNET_TX_COMBINE_SIZE > 0
+  if (tx_combine & (1 << _sock))
+    n += ETHERNET_TX_COMBINE_SIZE - tx_len[_sock];
+#endif
+  return n;
+}
+
+size_t EthernetClient::writeNonBlocking(const uint8_t *buf, size_t size) {
+  if (_sock == MAX_SOCK_NUM)
+    return 0;
+  // Data held back by write combining has to go first to keep the order
+#if ETHERNET_TX_COMBINE_SIZE > 0
+  if (tx_len[_sock]) {
+    uint16_t held = sendNonBlocking(_sock, tx_buf[_sock], tx_len[_sock]);
+    tx_len[_sock] -= held;
+    memmove(tx_buf[_sock], tx_buf[_sock] + held, tx_len[_sock]);
+    if (tx_len[_sock])
+      return 0;
+  }
+#endif
+  if (size > 0xFFFF)
+    size = 0xFFFF;
+  return sendNonBlocking(_sock, buf, size);
+}
+
+int EthernetClient::setWriteCombining(bool on) {
+#if ETHERNET_TX_COMBINE_SIZE > 0
+  if (_sock == MAX_SOCK_NUM)
+    return 0;
+  if (on) {
+    tx_combine |= (1 << _sock);
+  }
+  else {
+    commitWrites();
+    tx_combine &= ~(1 << _sock);
+  }
+  return 1;
+#else
+  (void)on;
+  return 0;
+#endif
+}
+
+// Send whatever write combining is holding back for the socket.
+// Returns 0 if that failed.
+int EthernetClient::commitWrites() {
+#if ETHERNET_TX_COMBINE_SIZE > 0
+  if (_sock == MAX_SOCK_NUM || tx_len[_sock] == 0)
+    return 1;
+  uint16_t len = tx_len[_sock];
+  tx_len[_sock] = 0;
+  if (!send(_sock, tx_buf[_sock], len)) {
     setWriteError();
     return 0;
   }
-  return size;
+#endif
+  return 1;
+}
+
+void EthernetClient::commitIfIdle() {
+#if ETHERNET_TX_COMBINE_SIZE > 0
+  if (_sock != MAX_SOCK_NUM && tx_len[_sock] &&
+      millis() - tx_since[_sock] >= ETHERNET_TX_COMBINE_IDLE_MS)
+    commitWrites();
+#endif
+}
+
+void EthernetClient::resetSocket(uint8_t sock) {
+#if ETHERNET_TX_COMBINE_SIZE > 0
+  tx_combine &= ~(1 << sock);
+  tx_len[sock] = 0;
+#endif
+#if ETHERNET_RX_READAHEAD_SIZE > 0
+  rx_pos[sock] = rx_len[sock] = 0;
+#endif
+  connecting &= ~(1 << sock);
+}
+
+uint16_t EthernetClient::readAhead(uint8_t sock) {
+#if ETHERNET_RX_READAHEAD_SIZE > 0
+  if (sock < MAX_SOCK_NUM)
+    return rx_len[sock] - rx_pos[sock];
+#else
+  (void)sock;
+#endif
+  return 0;
 }
 
 int EthernetClient::available() {
-  if (_sock != MAX_SOCK_NUM)
-    return recvAvailable(_sock);
+  if (_sock != MAX_SOCK_NUM) {
+    commitIfIdle();
+    return readAhead(_sock) + recvAvailable(_sock);
+  }
   return 0;
 }
 
 int EthernetClient::read() {
+  commitWrites();
+#if ETHERNET_RX_READAHEAD_SIZE > 0
+  if (_sock != MAX_SOCK_NUM && readAhead(_sock) == 0) {
+    // Take all that is there, up to a buffer full, in one recv()
+    int16_t n = recv(_sock, rx_buf[_sock], ETHERNET_RX_READAHEAD_SIZE);
+    rx_pos[_sock] = 0;
+    rx_len[_sock] = n > 0 ? n : 0;
+  }
+  if (readAhead(_sock))
+    return rx_buf[_sock][rx_pos[_sock]++];
+  return -1;
+#else
   uint8_t b;
   if ( recv(_sock, &b, 1) > 0 )
   {
@@ -104,22 +300,59 @@ int EthernetClient::read() {
     // No data available
     return -1;
   }
+#endif
 }
 
 int EthernetClient::read(uint8_t *buf, size_t size) {
+  commitWrites();
+#if ETHERNET_RX_READAHEAD_SIZE > 0
+  uint16_t held = readAhead(_sock);
+  if (held) {
+    if (held > size)
+      held = size;
+    memcpy(buf, &rx_buf[_sock][rx_pos[_sock]], held);
+    rx_pos[_sock] += held;
+    if (held == size)
+      return held;
+    // Top up straight from the chip; an empty socket isn't an error now
+    int16_t n = recv(_sock, buf + held, size - held);
+    return n > 0 ? held + n : held;
+  }
+#endif
   return recv(_sock, buf, size);
 }
 
 int EthernetClient::peek() {
+  WiznetBus bus;
+  commitWrites();
+#if ETHERNET_RX_READAHEAD_SIZE > 0
+  if (_sock == MAX_SOCK_NUM)
+    return -1;
+  if (readAhead(_sock) == 0) {
+    int16_t n = recv(_sock, rx_buf[_sock], ETHERNET_RX_READAHEAD_SIZE);
+    rx_pos[_sock] = 0;
+    rx_len[_sock] = n > 0 ? n : 0;
+  }
+  if (readAhead(_sock))
+    return rx_buf[_sock][rx_pos[_sock]];
+  return -1;
+#else
   uint8_t b;
   // Unlike recv, peek doesn't check to see if there's any data available, so we must
   if (!available())
     return -1;
   ::peek(_sock, &b);
   return b;
+#endif
 }
 
 void EthernetClient::flush() {
+  WiznetBus bus;
+  commitWrites();
+#if ETHERNET_RX_READAHEAD_SIZE > 0
+  if (_sock != MAX_SOCK_NUM)
+    rx_pos[_sock] = rx_len[_sock] = 0;
+#endif
   while (available())
     read();
 }
@@ -128,6 +361,14 @@ void EthernetClient::stop() {
   if (_sock == MAX_SOCK_NUM)
     return;
 
+  commitWrites();
+#if ETHERNET_TX_COMBINE_SIZE > 0
+  tx_combine &= ~(1 << _sock);
+#endif
+#if ETHERNET_RX_READAHEAD_SIZE > 0
+  rx_pos[_sock] = rx_len[_sock] = 0;
+#endif
+
   // attempt to close the connection gracefully (send a FIN to other side)
   disconnect(_sock);
   unsigned long start = millis();
@@ -147,6 +388,8 @@ void EthernetClient::stop() {
 uint8_t EthernetClient::connected() {
   if (_sock == MAX_SOCK_NUM) return 0;
   
+  WiznetBus bus;
+  commitIfIdle();
   uint8_t s = status();
   return !(s == SnSR::LISTEN || s == SnSR::CLOSED || s == SnSR::FIN_WAIT ||
     (s == SnSR::CLOSE_WAIT && !available()));
@@ -5,6 +5,43 @@
 #include "Client.h"
 #include "IPAddress.h"
 
+// Bytes of small writes a client can hold back and send as one segment once
+// setWriteCombining() is on. The buffers are one per socket; 0 leaves them out.
+#ifndef ETHERNET_TX_COMBINE_SIZE
+#if defined(__AVR__)
+#define ETHERNET_TX_COMBINE_SIZE 0
+#else
+#define ETHERNET_TX_COMBINE_SIZE 128
+#endif
+#endif
+
+// Held-back writes go out once they are this old, at the next call on the client
+#ifndef ETHERNET_TX_COMBINE_IDLE_MS
+#define ETHERNET_TX_COMBINE_IDLE_MS 20
+#endif
+
+// Bytes a client pulls from the chip in one go to serve read(), peek() and
+// available() from RAM. The buffers are one per socket; 0 leaves them out.
+#ifndef ETHERNET_RX_READAHEAD_SIZE
+#if defined(__AVR__)
+#define ETHERNET_RX_READAHEAD_SIZE 0
+#else
+#define ETHERNET_RX_READAHEAD_SIZE 64
+#endif
+#endif
+
+// How long connect() waits for the connection to come up, unless
+// setConnectionTimeout() says otherwise
+#ifndef ETHERNET_CONNECT_TIMEOUT_MS
+#define ETHERNET_CONNECT_TIMEOUT_MS 10000
+#endif
+
+// connectState() and finishConnect() results
+#define ETHERNET_CONNECT_DONE     1
+#define ETHERNET_CONNECT_BUSY     0
+#define ETHERNET_CONNECT_TIMEOUT -1
+#define ETHERNET_CONNECT_FAILED  -2
+
 class EthernetClient : public Client {
 
 public:
@@ -14,8 +51,21 @@ public:
   uint8_t status();
   virtual int connect(IPAddress ip, uint16_t port);
   virtual int connect(const char *host, uint16_t port);
+  // Start connecting and return straight away. Returns 1 if the connection
+  // attempt is under way, 0 if there are no sockets available to use
+  int connectAsync(IPAddress ip, uint16_t port);
+  // How the connection attempt is going: ETHERNET_CONNECT_DONE, _BUSY,
+  // _TIMEOUT or _FAILED
+  int8_t connectState();
+  // As connectState(), but gives the socket up if the attempt has failed
+  int8_t finishConnect();
+  void setConnectionTimeout(uint16_t ms);
   virtual size_t write(uint8_t);
   virtual size_t write(const uint8_t *buf, size_t size);
+  // Bytes that can be written now without waiting
+  int availableForWrite();
+  // Write as much as fits without waiting. Returns the number of bytes taken
+  size_t writeNonBlocking(const uint8_t *buf, size_t size);
   virtual int available();
   virtual int read();
   virtual int read(uint8_t *buf, size_t size);
@@ -25,6 +75,11 @@ public:
   virtual uint8_t connected();
   virtual operator bool();
 
+  // Collect small writes and send them in one go, when the buffer fills, on
+  // flush(), read(), peek() or stop(), or after ETHERNET_TX_COMBINE_IDLE_MS.
+  // Returns 0 if write combining is compiled out
+  int setWriteCombining(bool on);
+
   friend class EthernetServer;
   
   using Print::write;
@@ -32,6 +87,12 @@ public:
 private:
   static uint16_t _srcport;
   uint8_t _sock;
+  uint16_t _timeout;
+
+  int commitWrites();
+  void commitIfIdle();
+  static uint16_t readAhead(uint8_t sock); // Bytes held in the read-ahead buffer
+  static void resetSocket(uint8_t sock);  // Forget what the socket's last connection left behind
 };
 
 #endif
@@ -0,0 +1,280 @@
+#include "wiznet.h"
+#include "socket.h"
+#include "Ethernet.h"
+#include "EthernetPing.h"
+
+#define INVALID_SOCKET ((uint8_t)-1)
+
+#define ICMP_ECHO_REPLY   0
+#define ICMP_ECHO_REQUEST 8
+
+// Echo header, then the micros() the request left at, then padding
+#define PING_MESSAGE_SIZE 32
+
+#define PING_DEFAULT_INTERVAL_MS 1000
+#define PING_DEFAULT_TIMEOUT_MS  1000
+
+static uint16_t checksum(const uint8_t *buf, uint16_t len)
+{
+  uint32_t sum = 0;
+  for (uint16_t i = 0; i + 1 < len; i += 2)
+    sum += (buf[i] << 8) | buf[i + 1];
+  if (len & 1)
+    sum += buf[len - 1] << 8;
+  while (sum >> 16)
+    sum = (sum & 0xFFFF) + (sum >> 16);
+  return ~sum;
+}
+
+EthernetPing::EthernetPing()
+  : _sock(INVALID_SOCKET), _id(0), _next(0),
+    _interval(PING_DEFAULT_INTERVAL_MS), _timeout(PING_DEFAULT_TIMEOUT_MS)
+{
+  memset(_targets, 0, sizeof(_targets));
+}
+
+uint8_t EthernetPing::begin()
+{
+  if (_sock != INVALID_SOCKET)
+    return 0;
+
+  SocketSnapshot snap[MAX_SOCK_NUM];
+  socketSnapshot(snap);
+
+  for (int i = 0; i < MAX_SOCK_NUM; i++) {
+    uint8_t s = snap[i].sr;
+    if (s == SnSR::CLOSED || s == SnSR::FIN_WAIT) {
+      _sock = i;
+      break;
+    }
+  }
+  if (_sock == INVALID_SOCKET)
+    return 0;
+
+  EthernetClass::_server_port[_sock] = 0;
+  if (!socketRaw(_sock, IPPROTO::ICMP)) {
+    _sock = INVALID_SOCKET;
+    return 0;
+  }
+  // Tell our replies apart from those to anyone else pinging from this host
+  _id = micros();
+  return 1;
+}
+
+void EthernetPing::end()
+{
+  if (_sock == INVALID_SOCKET)
+    return;
+  close(_sock);
+  _sock = INVALID_SOCKET;
+}
+
+int EthernetPing::addTarget(IPAddress ip)
+{
+  for (int t = 0; t < ETHERNET_PING_TARGETS; t++) {
+    if (!_targets[t].active) {
+      memset(&_targets[t], 0, sizeof(Target));
+      for (int i = 0; i < 4; i++)
+        _targets[t].ip[i] = ip[i];
+      _targets[t].active = 1;
+      _targets[t].answered = 1;
+      return t;
+    }
+  }
+  return -1;
+}
+
+void EthernetPing::removeTarget(int target)
+{
+  if (valid(target))
+    _targets[target].active = 0;
+}
+
+void EthernetPing::setInterval(uint16_t ms)
+{
+  _interval = ms;
+}
+
+void EthernetPing::setTimeout(uint16_t ms)
+{
+  _timeout = ms;
+}
+
+void EthernetPing::poll()
+{
+  if (_sock == INVALID_SOCKET)
+    return;
+
+  // A byte to spare, so a longer reply shows up as one
+  uint8_t msg[PING_MESSAGE_SIZE + 1];
+  uint8_t addr[4];
+  uint16_t port;
+
+  // One bus session for the whole round
+  WiznetBus bus;
+
+  // Replies first, so none is judged against a request sent after it
+  while (recvAvailable(_sock) > 0) {
+    uint16_t len = recvfrom(_sock, msg, sizeof(msg), addr, &port);
+    if (len == 0)
+      break;
+    takeReply(addr, msg, len);
+  }
+
+  // Requests are sent without waiting for the chip. While one is still going
+  // out (held up resolving an unreachable host, say) the rest wait for a
+  // later call, and the scan starts after the last one sent so each gets a turn
+  unsigned long now = millis();
+  for (uint8_t i = 0; i < ETHERNET_PING_TARGETS; i++) {
+    uint8_t t = (_next + i) % ETHERNET_PING_TARGETS;
+    Target &target = _targets[t];
+    if (!target.active || (target.sent != 0 && now - target.sentAt < _interval))
+      continue;
+    if (socketCommandPoll(_sock) == SOCK_CMD_BUSY)
+      break;
+    sendRequest(t);
+    _next = t + 1;
+  }
+}
+
+void EthernetPing::sendRequest(uint8_t t)
+{
+  Target &target = _targets[t];
+  uint8_t msg[PING_MESSAGE_SIZE];
+  uint16_t id = _id + t;
+  uint32_t stamp = micros();
+
+  target.seq++;
+  memset(msg, 0, sizeof(msg));
+  msg[0] = ICMP_ECHO_REQUEST;
+  msg[4] = id >> 8;
+  msg[5] = id;
+  msg[6] = target.seq >> 8;
+  msg[7] = target.seq;
+  msg[8] = stamp >> 24;
+  msg[9] = stamp >> 16;
+  msg[10] = stamp >> 8;
+  msg[11] = stamp;
+  uint16_t sum = checksum(msg, sizeof(msg));
+  msg[2] = sum >> 8;
+  msg[3] = sum;
+
+  // A request the chip couldn't send (no ARP reply, say) still counts, as lost
+  sendtoAsync(_sock, msg, sizeof(msg), target.ip, 0);
+  target.sentAt = millis();
+  target.answered = 0;
+  target.sent++;
+}
+
+void EthernetPing::takeReply(const uint8_t *addr, const uint8_t *msg, uint16_t len)
+{
+  uint32_t now = micros();
+
+  // Our replies echo our requests, so anything else is someone else's
+  if (len != PING_MESSAGE_SIZE || msg[0] != ICMP_ECHO_REPLY || msg[1] != 0 || checksum(msg, len) != 0)
+    return;
+
+  uint16_t t = ((msg[4] << 8) | msg[5]) - _id;
+  if (t >= ETHERNET_PING_TARGETS)
+    return;
+  Target &target = _targets[t];
+  uint16_t seq = (msg[6] << 8) | msg[7];
+  if (!target.active || target.answered || seq != target.seq || memcmp(addr, target.ip, 4) != 0)
+    return;
+
+  uint32_t stamp = ((uint32_t)msg[8] << 24) | ((uint32_t)msg[9] << 16) | ((uint32_t)msg[10] << 8) | msg[11];
+  uint32_t rtt = now - stamp;
+  if (rtt > (uint32_t)_timeout * 1000)
+    return;
+
+  target.answered = 1;
+  if (target.received == 0 || rtt < target.minRtt)
+    target.minRtt = rtt;
+  if (rtt > target.maxRtt)
+    target.maxRtt = rtt;
+  target.sumRtt += rtt;
+  target.received++;
+
+  uint8_t b = 0;
+  while (b < ETHERNET_PING_BUCKETS - 1 && rtt >= (128UL << b))
+    b++;
+  if (target.hist[b] != 0xFFFF)
+    target.hist[b]++;
+}
+
+uint32_t EthernetPing::sent(int target)
+{
+  return valid(target) ? _targets[target].sent : 0;
+}
+
+uint32_t EthernetPing::received(int target)
+{
+  return valid(target) ? _targets[target].received : 0;
+}
+
+uint32_t EthernetPing::lost(int target)
+{
+  if (!valid(target))
+    return 0;
+  Target &t = _targets[target];
+  uint32_t lost = t.sent - t.received;
+  // The latest request may still be on its way back
+  if (!t.answered && t.sent > 0 && millis() - t.sentAt < _timeout)
+    lost--;
+  return lost;
+}
+
+uint32_t EthernetPing::minRtt(int target)
+{
+  return valid(target) ? _targets[target].minRtt : 0;
+}
+
+uint32_t EthernetPing::avgRtt(int target)
+{
+  if (!valid(target) || _targets[target].received == 0)
+    return 0;
+  return _targets[target].sumRtt / _targets[target].received;
+}
+
+uint32_t EthernetPing::maxRtt(int target)
+{
+  return valid(target) ? _targets[target].maxRtt : 0;
+}
+
+uint32_t EthernetPing::percentileRtt(int target, uint8_t pct)
+{
+  if (!valid(target) || _targets[target].received == 0)
+    return 0;
+
+  Target &t = _targets[target];
+  uint32_t total = 0;
+  for (uint8_t b = 0; b < ETHERNET_PING_BUCKETS; b++)
+    total += t.hist[b];
+
+  uint32_t want = (total * pct + 99) / 100;
+  uint32_t seen = 0;
+  for (uint8_t b = 0; b < ETHERNET_PING_BUCKETS - 1; b++) {
+    seen += t.hist[b];
+    if (seen >= want)
+      return 128UL << b;
+  }
+  return t.maxRtt;
+}
+
+uint16_t EthernetPing::histogram(int target, uint8_t bucket)
+{
+  if (!valid(target) || bucket >= ETHERNET_PING_BUCKETS)
+    return 0;
+  return _targets[target].hist[bucket];
+}
+
+void EthernetPing::resetStats(int target)
+{
+  if (!valid(target))
+    return;
+  Target &t = _targets[target];
+  t.sent = t.received = 0;
+  t.minRtt = t.maxRtt = t.sumRtt = 0;
+  t.answered = 1;
+  memset(t.hist, 0, sizeof(t.hist));
+}
@@ -0,0 +1,89 @@
+#ifndef ethernetping_h
+#define ethernetping_h
+
+#include "Arduino.h"
+#include "IPAddress.h"
+
+// Hosts one EthernetPing can probe at once
+#ifndef ETHERNET_PING_TARGETS
+#define ETHERNET_PING_TARGETS 4
+#endif
+
+// Round trip time buckets. Bucket i counts replies faster than 128 << i
+// microseconds; the last one takes everything slower.
+#define ETHERNET_PING_BUCKETS 16
+
+/*
+Measures round trip times to a set of hosts with ICMP echo, all over one
+IP RAW socket.
+
+poll() sends each target a request every interval and takes whatever
+replies have come in, without waiting for any. Each request carries its
+sequence number and the micros() it left at, so a reply is matched and
+timed from its own contents. A reply slower than the timeout counts as lost.
+
+A reply is timed when poll() takes it in, so round trip times are only as
+fine as the gap between calls to poll().
+*/
+class EthernetPing {
+public:
+  EthernetPing();
+
+  // Open a socket for ICMP. Returns 1 if successful, 0 if there are no sockets available to use
+  uint8_t begin();
+  void end();
+
+  // Start probing ip. Returns the target's index, or -1 if all are taken
+  int addTarget(IPAddress ip);
+  void removeTarget(int target);
+
+  // Only a target's latest request is matched, so the interval should be at
+  // least the timeout
+  void setInterval(uint16_t ms);
+  void setTimeout(uint16_t ms);
+
+  // Send the requests that are due and take in the replies
+  void poll();
+
+  // Statistics for one target. Times are in microseconds
+  uint32_t sent(int target);
+  uint32_t received(int target);
+  // Requests whose reply did not come back within the timeout
+  uint32_t lost(int target);
+  uint32_t minRtt(int target);
+  uint32_t avgRtt(int target);
+  uint32_t maxRtt(int target);
+  // Time within which pct percent of replies came back, to the upper edge
+  // of the bucket it falls in
+  uint32_t percentileRtt(int target, uint8_t pct);
+  uint16_t histogram(int target, uint8_t bucket);
+  void resetStats(int target);
+
+private:
+  struct Target {
+    uint8_t ip[4];
+    uint8_t active;
+    uint8_t answered;    // The last request has its reply
+    uint16_t seq;
+    unsigned long sentAt;
+    uint32_t sent;
+    uint32_t received;
+    uint32_t minRtt;
+    uint32_t maxRtt;
+    uint32_t sumRtt;
+    uint16_t hist[ETHERNET_PING_BUCKETS];
+  };
+
+  uint8_t _sock;
+  uint16_t _id;
+  uint8_t _next;       // Target the next scan for due requests starts at
+  uint16_t _interval;
+  uint16_t _timeout;
+  Target _targets[ETHERNET_PING_TARGETS];
+
+  void sendRequest(uint8_t t);
+  void takeReply(const uint8_t *addr, const uint8_t *msg, uint16_t len);
+  uint8_t valid(int target) { return target >= 0 && target < ETHERNET_PING_TARGETS && _targets[target].active; };
+};
+
+#endif
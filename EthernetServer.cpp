@@ -8,58 +8,144 @@ extern "C" {
 #include "EthernetClient.h"
 #include "EthernetServer.h"
 
-EthernetServer::EthernetServer(uint16_t port)
+#if ETHERNET_SERVER_QUEUE_SIZE > 0
+// What write() still owes each client, kept per socket like the client's
+// own buffers
+static uint8_t out_buf[MAX_SOCK_NUM][ETHERNET_SERVER_QUEUE_SIZE];
+static uint16_t out_len[MAX_SOCK_NUM];
+#endif
+
+EthernetServer::EthernetServer(uint16_t port, uint8_t backlog)
 {
   _port = port;
+  _backlog = backlog ? backlog : 1;
+  _cursor = MAX_SOCK_NUM - 1;
+  _served = 0;
+  memset(_weight, 1, sizeof(_weight));
+  _accepted = 0;
+  _closing = 0;
+  _disconnectEvents = 0;
 }
 
 void EthernetServer::begin()
 {
+  WiznetBus bus;
+  SocketSnapshot snap[MAX_SOCK_NUM];
+  socketSnapshot(snap);
+  fillBacklog(snap);
+}
+
+// Top the listeners on our port back up to the backlog, from sockets snap
+// shows as closed
+void EthernetServer::fillBacklog(SocketSnapshot *snap)
+{
+  uint8_t listening = 0;
+  uint8_t closed = 0;
+
   for (int sock = 0; sock < MAX_SOCK_NUM; sock++) {
-    EthernetClient client(sock);
-    if (client.status() == SnSR::CLOSED) {
-      socket(sock, SnMR::TCP, _port, 0);
-      listen(sock);
-      EthernetClass::_server_port[sock] = _port;
+    if (snap[sock].sr == SnSR::CLOSED && !(_closing & (1 << sock)))
+      closed++;
+    else if (snap[sock].sr == SnSR::LISTEN && EthernetClass::_server_port[sock] == _port)
+      listening++;
+  }
+
+  for (int sock = 0; sock < MAX_SOCK_NUM && listening < _backlog; sock++) {
+    if (snap[sock].sr != SnSR::CLOSED || (_closing & (1 << sock)))
+      continue;
+    if (listening > 0 && closed <= ETHERNET_SERVER_RESERVED_SOCKETS)
       break;
-    }
-  }  
+    closed--;
+#if ETHERNET_SERVER_QUEUE_SIZE > 0
+    out_len[sock] = 0;
+#endif
+    EthernetClient::resetSocket(sock);
+    if (!socket(sock, SnMR::TCP, _port, 0))
+      continue;
+    listen(sock);
+    EthernetClass::_server_port[sock] = _port;
+    snap[sock].sr = SnSR::LISTEN;
+    listening++;
+  }
 }
 
-void EthernetServer::accept()
+// Take a snapshot into snap and bring the server's sockets up to date with it
+void EthernetServer::serviceSockets(SocketSnapshot *snap)
 {
-  int listening = 0;
+  uint8_t finished = 0; // bit per socket
 
+  WiznetBus::begin();
+  socketSnapshot(snap);
   for (int sock = 0; sock < MAX_SOCK_NUM; sock++) {
-    EthernetClient client(sock);
-
-    if (EthernetClass::_server_port[sock] == _port) {
-      if (client.status() == SnSR::LISTEN) {
-        listening = 1;
-      } 
-      else if (client.status() == SnSR::CLOSE_WAIT && !client.available()) {
-        client.stop();
-      }
+    uint8_t bit = 1 << sock;
+    if (EthernetClass::_server_port[sock] != _port) {
+      // Stopped by the sketch, and perhaps taken for something else since
+      _accepted &= ~bit;
+      _closing &= ~bit;
+      continue;
+    }
+
+    uint8_t sr = snap[sock].sr;
+    if ((_accepted & bit) && sr != SnSR::ESTABLISHED) {
+      _accepted &= ~bit;
+      if (_disconnectEvents)
+        _closing |= bit;
+    }
+
+    if (sr == SnSR::ESTABLISHED || sr == SnSR::CLOSE_WAIT)
+      drainQueue(sock);
+#if ETHERNET_SERVER_QUEUE_SIZE > 0
+    else
+      out_len[sock] = 0;
+#endif
+
+    if (sr == SnSR::LISTEN) {
+      // Whoever connects next starts out with an ordinary share
+      _weight[sock] = 1;
     } 
+    else if (sr == SnSR::CLOSE_WAIT && snap[sock].rx_rsr == 0 &&
+             !EthernetClient::readAhead(sock) && !(_closing & bit)) {
+      finished |= bit;
+      snap[sock].sr = SnSR::CLOSED;
+    }
   }
+  WiznetBus::end();
 
-  if (!listening) {
-    begin();
+  // stop() waits for the close with delay(), so it mustn't hold the bus
+  for (int sock = 0; sock < MAX_SOCK_NUM; sock++) {
+    if (finished & (1 << sock)) {
+      EthernetClient client(sock);
+      client.stop();
+    }
   }
+
+  // Replace any listener that has taken a connection since the last call
+  fillBacklog(snap);
 }
 
 EthernetClient EthernetServer::available()
 {
-  accept();
+  SocketSnapshot snap[MAX_SOCK_NUM];
+  serviceSockets(snap);
 
-  for (int sock = 0; sock < MAX_SOCK_NUM; sock++) {
-    EthernetClient client(sock);
+  // Start just past the socket served last, unless it has turns left; it
+  // comes round again at the end of the scan if no other one is ready
+  uint8_t first = (_served && _served < _weight[_cursor]) ? 0 : 1;
+  for (uint8_t i = first; i <= MAX_SOCK_NUM; i++) {
+    uint8_t sock = (_cursor + i) % MAX_SOCK_NUM;
     if (EthernetClass::_server_port[sock] == _port &&
-        (client.status() == SnSR::ESTABLISHED ||
-         client.status() == SnSR::CLOSE_WAIT)) {
-      if (client.available()) {
-        // XXX: don't always pick the lowest numbered socket.
-        return client;
+        (snap[sock].sr == SnSR::ESTABLISHED ||
+         snap[sock].sr == SnSR::CLOSE_WAIT)) {
+      if (snap[sock].rx_rsr > 0 || EthernetClient::readAhead(sock)) {
+        if (i % MAX_SOCK_NUM == 0 && _served < _weight[sock]) {
+          _served++;
+        }
+        else {
+          _cursor = sock;
+          _served = 1;
+        }
+        if (snap[sock].sr == SnSR::ESTABLISHED)
+          _accepted |= (1 << sock);
+        return EthernetClient(sock);
       }
     }
   }
@@ -67,23 +153,111 @@ EthernetClient EthernetServer::available()
   return EthernetClient(MAX_SOCK_NUM);
 }
 
+void EthernetServer::setWeight(EthernetClient &client, uint8_t weight)
+{
+  if (client._sock < MAX_SOCK_NUM)
+    _weight[client._sock] = weight ? weight : 1;
+}
+
+EthernetClient EthernetServer::accept()
+{
+  SocketSnapshot snap[MAX_SOCK_NUM];
+  serviceSockets(snap);
+
+  for (int sock = 0; sock < MAX_SOCK_NUM; sock++) {
+    if (EthernetClass::_server_port[sock] == _port &&
+        snap[sock].sr == SnSR::ESTABLISHED && !(_accepted & (1 << sock))) {
+      _accepted |= (1 << sock);
+      return EthernetClient(sock);
+    }
+  }
+
+  return EthernetClient(MAX_SOCK_NUM);
+}
+
+void EthernetServer::setDisconnectEvents(bool on)
+{
+  _disconnectEvents = on;
+  if (!on)
+    _closing = 0;
+}
+
+EthernetClient EthernetServer::disconnected()
+{
+  SocketSnapshot snap[MAX_SOCK_NUM];
+  serviceSockets(snap);
+
+  for (int sock = 0; sock < MAX_SOCK_NUM; sock++) {
+    if (_closing & (1 << sock)) {
+      _closing &= ~(1 << sock);
+      return EthernetClient(sock);
+    }
+  }
+
+  return EthernetClient(MAX_SOCK_NUM);
+}
+
 size_t EthernetServer::write(uint8_t b) 
 {
   return write(&b, 1);
 }
 
+// Move what fits of the socket's queue into its TX buffer, and get a SEND
+// going for whatever is waiting there
+void EthernetServer::drainQueue(uint8_t sock)
+{
+#if ETHERNET_SERVER_QUEUE_SIZE > 0
+  if (out_len[sock] > 0) {
+    uint16_t n = sendNonBlocking(sock, out_buf[sock], out_len[sock]);
+    if (n > 0) {
+      out_len[sock] -= n;
+      memmove(out_buf[sock], out_buf[sock] + n, out_len[sock]);
+    }
+    return;
+  }
+#endif
+  // The tail of the last write may be staged behind a SEND that has since
+  // finished, and no later write may come along to send it
+  socketCommandPoll(sock);
+}
+
 size_t EthernetServer::write(const uint8_t *buffer, size_t size) 
 {
   size_t n = 0;
-  
-  accept();
+  SocketSnapshot snap[MAX_SOCK_NUM];
+  serviceSockets(snap);
 
-  for (int sock = 0; sock < MAX_SOCK_NUM; sock++) {
-    EthernetClient client(sock);
+  WiznetBus bus;
 
+  for (int sock = 0; sock < MAX_SOCK_NUM; sock++) {
     if (EthernetClass::_server_port[sock] == _port &&
-      client.status() == SnSR::ESTABLISHED) {
-      n += client.write(buffer, size);
+      snap[sock].sr == SnSR::ESTABLISHED) {
+      // Anything the client is holding back goes first
+      EthernetClient client(sock);
+      if (!client.commitWrites())
+        continue;
+
+      // Whole writes only: a client short of room misses this one
+      uint16_t queued = 0;
+      uint16_t room = 0;
+#if ETHERNET_SERVER_QUEUE_SIZE > 0
+      queued = out_len[sock];
+      room = ETHERNET_SERVER_QUEUE_SIZE - queued;
+#endif
+      if (queued == 0)
+        room += sendAvailable(sock);
+      if (size > room)
+        continue;
+
+      uint16_t sent = 0;
+      if (queued == 0)
+        sent = sendNonBlocking(sock, buffer, size);
+#if ETHERNET_SERVER_QUEUE_SIZE > 0
+      memcpy(out_buf[sock] + queued, buffer + sent, size - sent);
+      out_len[sock] += size - sent;
+      sent = size;
+#endif
+      n += sent;
     }
   }
   
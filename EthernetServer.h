@@ -2,18 +2,65 @@
 #define ethernetserver_h
 
 #include "Server.h"
+#include "wiznet.h"
+
+// Sockets a server leaves free for clients, DNS and DHCP when it fills its
+// backlog. Its first listener is taken regardless.
+#ifndef ETHERNET_SERVER_RESERVED_SOCKETS
+#define ETHERNET_SERVER_RESERVED_SOCKETS 1
+#endif
+
+// Bytes of server-wide writes each client can have waiting in RAM behind a
+// full TX buffer. The queues are one per socket; 0 leaves them out.
+#ifndef ETHERNET_SERVER_QUEUE_SIZE
+#if defined(__AVR__)
+#define ETHERNET_SERVER_QUEUE_SIZE 0
+#else
+#define ETHERNET_SERVER_QUEUE_SIZE 128
+#endif
+#endif
 
 class EthernetClient;
+struct SocketSnapshot;
 
 class EthernetServer : 
 public Server {
 private:
   uint16_t _port;
-  void accept();
+  uint8_t _backlog;                // Sockets to keep listening
+  uint8_t _cursor;                 // Socket available() last handed out
+  uint8_t _served;                 // Times in a row it has been handed out
+  uint8_t _weight[MAX_SOCK_NUM];
+  uint8_t _accepted;               // bit per socket: connection handed out
+  uint8_t _closing;                // bit per socket: disconnect not yet reported
+  uint8_t _disconnectEvents;
+  void serviceSockets(SocketSnapshot *snap);
+  static void drainQueue(uint8_t sock);
+  void fillBacklog(SocketSnapshot *snap);
 public:
-  EthernetServer(uint16_t);
+  // Keep up to backlog sockets listening on port, so that connections
+  // arriving together are all taken
+  EthernetServer(uint16_t port, uint8_t backlog = 1);
+  // A client with data waiting. Clients with data take turns, each
+  // returned as many times in a row as its weight
   EthernetClient available();
+  // Give client up to weight turns in a row (1 to start with) for as long
+  // as its connection lasts
+  void setWeight(EthernetClient &client, uint8_t weight);
+  // Each new connection once, as soon as it is established, whether or not
+  // the client has sent anything yet
+  EthernetClient accept();
+  // With disconnect events on, each connection handed out by accept() or
+  // available() is returned here once when the client closes it. Until then
+  // the server leaves the socket alone, so the sketch should call
+  // disconnected() regularly and stop() what it returns
+  void setDisconnectEvents(bool on);
+  EthernetClient disconnected();
   virtual void begin();
+  // Write to every connected client without waiting on any. The data goes
+  // into each TX buffer and all the SENDs go out together; a client without
+  // room has it queued, or misses it if the queue has no room either.
+  // Returns the total number of bytes taken for all clients
   virtual size_t write(uint8_t);
   virtual size_t write(const uint8_t *buf, size_t size);
   using Print::write;
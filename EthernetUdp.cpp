@@ -38,29 +38,59 @@
 /* Constructor */
 EthernetUDP::EthernetUDP() : _sock(INVALID_SOCKET) {}
 
-/* Start EthernetUDP socket, listening at local port PORT */
-uint8_t EthernetUDP::begin(uint16_t port) {
+/* Pick a free socket for this instance. Returns 1 if one was found */
+uint8_t EthernetUDP::claimSocket() {
   if (_sock != INVALID_SOCKET) {
     WIZNET_DEBUGLN("EthernetUDP::begin: called on started socket");
     return 0;
   }
 
+  SocketSnapshot snap[MAX_SOCK_NUM];
+  socketSnapshot(snap);
+
   for (int i = 0; i < MAX_SOCK_NUM; i++) {
-    uint8_t s = socketStatus(i);
+    uint8_t s = snap[i].sr;
     if (s == SnSR::CLOSED || s == SnSR::FIN_WAIT) {
       _sock = i;
       break;
     }
   }
 
-  if (_sock == MAX_SOCK_NUM) {
+  if (_sock == INVALID_SOCKET) {
     WIZNET_DEBUGLN("EthernetUDP::begin: Ran out of sockets (MAX_SOCK_NUM exceeded)");
     return 0;
   }
+  // Take it from any server still keeping it to report as disconnected
+  EthernetClass::_server_port[_sock] = 0;
+  return 1;
+}
+
+/* Start EthernetUDP socket, listening at local port PORT */
+uint8_t EthernetUDP::begin(uint16_t port) {
+  if (!claimSocket())
+    return 0;
 
   _port = port;
   _remaining = 0;
-  socket(_sock, SnMR::UDP, _port, 0);
+  if (!socket(_sock, SnMR::UDP, _port, 0)) {
+    _sock = INVALID_SOCKET;
+    return 0;
+  }
+
+  return 1;
+}
+
+/* Start EthernetUDP socket as a member of multicast group IP, listening at PORT */
+uint8_t EthernetUDP::beginMulticast(IPAddress ip, uint16_t port) {
+  if (!claimSocket())
+    return 0;
+
+  _port = port;
+  _remaining = 0;
+  if (!socketMulticast(_sock, rawIPAddress(ip), _port)) {
+    _sock = INVALID_SOCKET;
+    return 0;
+  }
 
   return 1;
 }
@@ -128,38 +158,22 @@ size_t EthernetUDP::write(const uint8_t *buffer, size_t size)
 
 int EthernetUDP::parsePacket()
 {
+  if (_sock == INVALID_SOCKET)
+    return 0;
+
+  WiznetBus bus;
   // discard any remaining bytes in the last packet
   flush();
 
-  if (recvAvailable(_sock) > 0)
-  {
-    //HACK - hand-parse the UDP packet using TCP recv method
-    uint8_t tmpBuf[8];
-    int ret =0; 
-    //read 8 header bytes and get IP and port from it
-    ret = recv(_sock,tmpBuf,8);
-    if (ret > 0)
-    {
-      _remoteIP = tmpBuf;
-      _remotePort = tmpBuf[4];
-      _remotePort = (_remotePort << 8) + tmpBuf[5];
-      _remaining = tmpBuf[6];
-      _remaining = (_remaining << 8) + tmpBuf[7];
-
-      // When we get here, any remaining bytes are the data
-      ret = _remaining;
-    }
-    return ret;
-  }
-  // There aren't any packets available
-  return 0;
+  _remaining = recvDatagramBegin(_sock, rawIPAddress(_remoteIP), &_remotePort);
+  return _remaining;
 }
 
 int EthernetUDP::read()
 {
   uint8_t byte;
 
-  if ((_remaining > 0) && (recv(_sock, &byte, 1) > 0))
+  if ((_remaining > 0) && (recvDatagramRead(_sock, &byte, 1) > 0))
   {
     // We read things without any problems
     _remaining--;
@@ -172,58 +186,43 @@ int EthernetUDP::read()
 
 int EthernetUDP::read(unsigned char* buffer, size_t len)
 {
-
   if (_remaining > 0)
   {
-
-    int got;
-
-    if (_remaining <= len)
-    {
-      // data should fit in the buffer
-      got = recv(_sock, buffer, _remaining);
-    }
-    else
-    {
-      // too much data for the buffer, 
-      // grab as much as will fit
-      got = recv(_sock, buffer, len);
-    }
-
+    // grab as much of the packet as will fit
+    int got = recvDatagramRead(_sock, buffer, len > _remaining ? _remaining : len);
     if (got > 0)
     {
       _remaining -= got;
       return got;
     }
-
   }
 
   // If we get here, there's no data available or recv failed
   return -1;
-
 }
 
 int EthernetUDP::peek()
 {
-  uint8_t b;
-  // Unlike recv, peek doesn't check to see if there's any data available, so we must.
-  // If the user hasn't called parsePacket yet then return nothing otherwise they
-  // may get the UDP header
+  // Only the payload of a packet found by parsePacket can be peeked at,
+  // never its header
   if (!_remaining)
     return -1;
-  ::peek(_sock, &b);
-  return b;
+  return recvDatagramPeek(_sock);
 }
 
-void EthernetUDP::flush()
+int EthernetUDP::readPackets(DatagramInfo *packets, uint16_t maxPackets, uint8_t *arena, uint16_t arenaSize)
 {
-  // could this fail (loop endlessly) if _remaining > 0 and recv in read fails?
-  // should only occur if recv fails after telling us the data is there, lets
-  // hope the w5100 always behaves :)
+  if (_sock == INVALID_SOCKET)
+    return 0;
 
-  while (_remaining)
-  {
-    read();
-  }
+  _remaining = 0;
+  return recvDatagrams(_sock, packets, maxPackets, arena, arenaSize);
 }
 
+void EthernetUDP::flush()
+{
+  // Skip the rest of the packet in one step
+  if (_sock != INVALID_SOCKET)
+    recvDatagramEnd(_sock);
+  _remaining = 0;
+}
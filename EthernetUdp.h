@@ -41,6 +41,8 @@
 
 #define UDP_TX_PACKET_MAX_SIZE 24
 
+struct DatagramInfo;
+
 class EthernetUDP : public UDP {
 private:
   uint8_t _sock;  // socket ID for Wiz5100
@@ -50,9 +52,15 @@ private:
   uint16_t _offset; // offset into the packet being sent
   uint16_t _remaining; // remaining bytes of incoming packet yet to be processed
 
+  uint8_t claimSocket();
+
 public:
   EthernetUDP();  // Constructor
   virtual uint8_t begin(uint16_t);	// initialize, start listening on specified port. Returns 1 if successful, 0 if there are no sockets available to use
+  // Initialize as a member of multicast group ip, sending to and listening on port.
+  // beginPacket(ip, port) then reaches every member of the group with one send.
+  // Returns 1 if successful, 0 if ip is not a multicast address or there are no sockets available to use
+  virtual uint8_t beginMulticast(IPAddress ip, uint16_t port);
   virtual void stop();  // Finish with the UDP socket
 
   // Sending UDP packets
@@ -90,6 +98,13 @@ public:
   virtual int peek();
   virtual void flush();	// Finish reading the current packet
 
+  // Take up to maxPackets queued packets at once, copying their payloads one
+  // after another into arena and describing each in packets. Ends the
+  // current packet first. A packet too big for what is left of arena waits
+  // for the next call, unless it is the first, which is cut short.
+  // Returns the number of packets taken
+  int readPackets(DatagramInfo *packets, uint16_t maxPackets, uint8_t *arena, uint16_t arenaSize);
+
   // Return the IP address of the host who sent the current incoming packet
   virtual IPAddress remoteIP() { return _remoteIP; };
   // Return the port of the host who sent the current incoming packet
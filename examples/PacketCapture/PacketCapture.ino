@@ -0,0 +1,64 @@
+/*
+  Packet capture
+
+ This sketch captures the TCP traffic to and from port 80 that reaches the
+ shield and streams it to a host as a pcap file over UDP.
+
+ On the host, collect the stream before resetting the board:
+   nc -ul 5555 > capture.pcap
+ and open capture.pcap in Wireshark once done.
+
+ Circuit:
+ * Ethernet shield attached to pins 10, 11, 12, 13
+
+ This code is in the public domain.
+
+ */
+
+#include <SPI.h>
+#include <Ethernet.h>
+#include <EthernetUdp.h>
+#include <EthernetCapture.h>
+
+#if defined(WIZ550io_WITH_MACADDRESS) // Use assigned MAC address of WIZ550io
+;
+#else
+byte mac[] = {0xDE, 0xAD, 0xBE, 0xEF, 0xFE, 0xED};
+#endif
+IPAddress ip(192,168,1,177);
+IPAddress host(192,168,1,2);
+const unsigned int hostPort = 5555;
+
+uint8_t ring[1024];
+EthernetCapture capture(ring, sizeof(ring));
+EthernetUDP Udp;
+
+void setup() {
+  Serial.begin(9600);
+#if defined(WIZ550io_WITH_MACADDRESS)
+  Ethernet.begin(ip);
+#else
+  Ethernet.begin(mac, ip);
+#endif
+
+  // Socket 0 has to be free for the capture, so start it first
+  if (!capture.begin()) {
+    Serial.println("capture: socket 0 is in use");
+    while (true);
+  }
+  capture.setFilter(0, IPAddress(0,0,0,0), IPPROTO::TCP, 80);
+  Udp.begin(hostPort);
+
+  Udp.beginPacket(host, hostPort);
+  capture.writeHeader(Udp);
+  Udp.endPacket();
+}
+
+void loop() {
+  capture.poll();
+  while (capture.available()) {
+    Udp.beginPacket(host, hostPort);
+    capture.dump(Udp, 1024);
+    Udp.endPacket();
+  }
+}
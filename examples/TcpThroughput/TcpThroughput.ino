@@ -0,0 +1,90 @@
+/*
+  TCP throughput
+
+ This sketch measures how fast the shield moves TCP payload through
+ send() and recv(), and prints the result in bytes per second.
+
+ On the host, start a sink and a source before resetting the board:
+   nc -l 5001 > /dev/null      (send test)
+   nc -l 5002 < /dev/zero      (recv test)
+
+ Circuit:
+ * Ethernet shield attached to pins 10, 11, 12, 13
+
+ This code is in the public domain.
+
+ */
+
+#include <SPI.h>
+#include <Ethernet.h>
+
+#if defined(WIZ550io_WITH_MACADDRESS) // Use assigned MAC address of WIZ550io
+;
+#else
+byte mac[] = {0xDE, 0xAD, 0xBE, 0xEF, 0xFE, 0xED};
+#endif
+IPAddress ip(192,168,1,177);
+IPAddress host(192,168,1,2);
+
+const unsigned long testBytes = 256UL * 1024;
+
+uint8_t buffer[512];
+
+EthernetClient client;
+
+void setup() {
+  Serial.begin(9600);
+#if defined(WIZ550io_WITH_MACADDRESS)
+  Ethernet.begin(ip);
+#else
+  Ethernet.begin(mac, ip);
+#endif
+  delay(1000);
+
+  Serial.print("SPI clock: ");
+  Serial.println(Ethernet.tuneSPIClock());
+
+  memset(buffer, 'x', sizeof(buffer));
+
+  if (client.connect(host, 5001)) {
+    unsigned long sent = 0;
+    unsigned long start = millis();
+    while (sent < testBytes && client.connected()) {
+      sent += client.write(buffer, sizeof(buffer));
+    }
+    report("send", sent, millis() - start);
+    client.stop();
+  }
+  else {
+    Serial.println("send: connection failed");
+  }
+
+  if (client.connect(host, 5002)) {
+    unsigned long received = 0;
+    unsigned long start = millis();
+    while (received < testBytes && client.connected()) {
+      int n = client.read(buffer, sizeof(buffer));
+      if (n > 0)
+        received += n;
+    }
+    report("recv", received, millis() - start);
+    client.stop();
+  }
+  else {
+    Serial.println("recv: connection failed");
+  }
+}
+
+void loop() {
+}
+
+void report(const char *name, unsigned long bytes, unsigned long ms) {
+  Serial.print(name);
+  Serial.print(": ");
+  Serial.print(bytes);
+  Serial.print(" bytes in ");
+  Serial.print(ms);
+  Serial.print(" ms = ");
+  Serial.print(ms ? bytes * 1000 / ms : 0);
+  Serial.println(" bytes/s");
+}
@@ -59,6 +59,8 @@ void loop() {
   EthernetClient client = server.available();
   if (client) {
     Serial.println("new client");
+    // send the response below in a few large segments instead of one per print()
+    client.setWriteCombining(true);
     // an http request ends with a blank line
     boolean currentLineIsBlank = true;
     while (client.connected()) {
@@ -4,13 +4,147 @@ Common definitions for the wiznet chips
 #ifndef	_WIZNET_H_INCLUDED
 #define	_WIZNET_H_INCLUDED
 
+#include <string.h>
 #include <avr/pgmspace.h>
 #include <SPI.h>
 
-#define SPI_ETHERNET_SETTINGS SPISettings(14000000, MSBFIRST, SPI_MODE0)
+// Every bus transaction uses these prebuilt settings. They start at the
+// chip's WIZNET_SPI_CLOCK and change when the clock is tuned.
+#define SPI_ETHERNET_SETTINGS (WiznetClock::settings)
+
+class WiznetClock {
+public:
+  static SPISettings settings;
+  static uint32_t rate; // Hz, as asked of SPISettings; the core may round it down
+
+  static inline void set(uint32_t hz) {
+    rate = hz;
+    settings = SPISettings(hz, MSBFIRST, SPI_MODE0);
+  }
+};
+
+/*
+A session on the SPI bus, held for the lifetime of the object. Sessions nest:
+only the outermost one begins and ends the SPI transaction, so a caller can
+hold the bus across a run of library calls and each inner call costs no more
+than a counter update.
+*/
+class WiznetBus {
+public:
+  WiznetBus() { begin(); }
+  ~WiznetBus() { end(); }
+
+  static inline void begin() {
+    if (depth++ == 0)
+      SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+  }
+  static inline void end() {
+    if (--depth == 0)
+      SPI.endTransaction();
+  }
+  // Let go of the bus around a yield(), however deeply nested, so other
+  // devices get a turn while we wait on the chip
+  static void pause();
+
+private:
+  static uint8_t depth;
+
+  WiznetBus(const WiznetBus &);
+  WiznetBus &operator=(const WiznetBus &);
+};
+
+// How long a socket command may leave Sn_CR set before the chip is given up on.
+// It normally clears within microseconds.
+#ifndef WIZNET_CMD_TIMEOUT_MS
+#define WIZNET_CMD_TIMEOUT_MS 10
+#endif
 
 typedef uint8_t SOCKET;
 
+/*
+Block transfers for the data phase of a SPI frame. The caller asserts chip
+select; these stream the bytes back-to-back instead of paying a full
+SPI.transfer() call (and its wait for SPIF) per byte.
+*/
+class WiznetSPI {
+public:
+#if defined(__AVR__)
+  // Load the next byte while the current one is shifting, so the only stall
+  // per byte is the shift itself.
+  static inline void write(const uint8_t *buf, uint16_t len) {
+    if (len == 0)
+      return;
+    SPDR = *buf++;
+    while (--len) {
+      uint8_t out = *buf++;
+      while (!(SPSR & _BV(SPIF)))
+        ;
+      SPDR = out;
+    }
+    while (!(SPSR & _BV(SPIF)))
+      ;
+    (void)SPDR;
+  }
+
+  static inline void read(uint8_t *buf, uint16_t len) {
+    if (len == 0)
+      return;
+    SPDR = 0;
+    while (--len) {
+      while (!(SPSR & _BV(SPIF)))
+        ;
+      uint8_t in = SPDR;
+      SPDR = 0;
+      *buf++ = in;
+    }
+    while (!(SPSR & _BV(SPIF)))
+      ;
+    *buf = SPDR;
+  }
+#else
+  static inline void write(const uint8_t *buf, uint16_t len) {
+#if defined(SPI_HAS_TRANSFER_BUF)
+    SPI.transfer(buf, NULL, len);
+#else
+    // SPI.transfer(buf, count) overwrites its buffer with the received bytes,
+    // so stage the payload through a small scratch block.
+    uint8_t chunk[32];
+    while (len) {
+      uint16_t n = len > sizeof(chunk) ? sizeof(chunk) : len;
+      memcpy(chunk, buf, n);
+      SPI.transfer(chunk, n);
+      buf += n;
+      len -= n;
+    }
+#endif
+  }
+
+  static inline void read(uint8_t *buf, uint16_t len) {
+    memset(buf, 0, len);
+    SPI.transfer(buf, len);
+  }
+#endif
+};
+
+/*
+The registers a socket's owner polls, as read together by getSocketSnapshot().
+*/
+struct SocketSnapshot {
+  uint8_t ir;       // Sn_IR
+  uint8_t sr;       // Sn_SR
+  uint16_t rx_rsr;  // Sn_RX_RSR
+};
+
+/*
+Where recvDatagrams() put one UDP datagram in the caller's arena.
+*/
+struct DatagramInfo {
+  uint8_t addr[4];  // Sender's IP address
+  uint16_t port;    // Sender's port
+  uint16_t offset;  // Start of the payload in the arena
+  uint16_t length;  // Payload bytes copied
+};
+
 //typedef uint8_t SOCKET;
 /*
 class MR {
@@ -9,26 +9,360 @@ extern void yield(void);
 
 static uint16_t local_port;
 
+SPISettings WiznetClock::settings(WIZNET_SPI_CLOCK, MSBFIRST, SPI_MODE0);
+uint32_t WiznetClock::rate = WIZNET_SPI_CLOCK;
+uint8_t WiznetBus::depth = 0;
+
+void WiznetBus::pause()
+{
+  if (depth == 0) {
+    yield();
+    return;
+  }
+  SPI.endTransaction();
+  yield();
+  SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+}
+
+// Interrupt mode. Once socketEventsBegin() has been given the INTn pin, Sn_IR
+// bits are only fetched from the chip while INTn is asserted, and are kept in
+// sock_events until the library consumes them. The socket status is cached
+// between events too, so a socket with nothing happening costs no SPI traffic.
+#define NO_INT_PIN 0xFF
+static uint8_t int_pin = NO_INT_PIN;
+static volatile uint8_t int_flag;
+static uint8_t sock_events[MAX_SOCK_NUM];
+static uint8_t sock_status[MAX_SOCK_NUM];
+static uint8_t status_known; // bit per socket
+
+static void int_handler(void)
+{
+  int_flag = 1;
+}
+
+// True when interrupt mode is on and INTn has nothing for us
+static inline uint8_t eventsIdle()
+{
+  return int_pin != NO_INT_PIN && !int_flag && digitalRead(int_pin) != LOW;
+}
+
+// Move pending Sn_IR bits from the chip into sock_events. INTn is level
+// triggered, so the pin is checked as well as the edge flag.
+// The caller holds the SPI bus.
+static void serviceEvents()
+{
+  if (int_pin == NO_INT_PIN || eventsIdle())
+    return;
+  int_flag = 0;
+
+  uint8_t sockets = Wiznet.getSocketInterrupts();
+  for (SOCKET s = 0; s < MAX_SOCK_NUM; s++) {
+    if (sockets & (1 << s)) {
+      uint8_t ir = Wiznet.readSnIR(s);
+      Wiznet.writeSnIR(s, ir);
+      sock_events[s] |= ir;
+      if (ir & (SnIR::CON | SnIR::DISCON | SnIR::TIMEOUT))
+        status_known &= ~(1 << s);
+    }
+  }
+}
+
+// Pending Sn_IR bits for a socket. The caller holds the SPI bus.
+static uint8_t pendingIR(SOCKET s)
+{
+  if (int_pin == NO_INT_PIN)
+    return Wiznet.readSnIR(s);
+  serviceEvents();
+  return sock_events[s];
+}
+
+static void clearIR(SOCKET s, uint8_t bits)
+{
+  if (int_pin == NO_INT_PIN)
+    Wiznet.writeSnIR(s, bits);
+  else
+    sock_events[s] &= ~bits;
+}
+
+// Commands that move the socket to a new state drop its cached status
+static inline void statusChanged(SOCKET s)
+{
+  status_known &= ~(1 << s);
+}
+
+// States the chip only leaves with an interrupt or on a command from us
+static inline uint8_t stableStatus(uint8_t status)
+{
+  return status == SnSR::CLOSED || status == SnSR::INIT || status == SnSR::LISTEN ||
+    status == SnSR::ESTABLISHED || status == SnSR::CLOSE_WAIT ||
+    status == SnSR::UDP || status == SnSR::IPRAW || status == SnSR::MACRAW;
+}
+
+
 /**
- * @brief	This Socket function initialize the channel in perticular mode, and set the port and wait for Wiznet done it.
- * @return 	1 for success else 0.
+ * @brief	Switch to interrupt mode, with INTn wired to the given pin.
+ * @return	1 for success else 0.
  */
-uint8_t socket(SOCKET s, uint8_t protocol, uint16_t port, uint8_t flag)
+uint8_t socketEventsBegin(uint8_t pin)
+{
+  if (pin == NO_INT_PIN)
+    return 0;
+  socketEventsEnd();
+
+  pinMode(pin, INPUT_PULLUP);
+  for (SOCKET s = 0; s < MAX_SOCK_NUM; s++) {
+    // Data may already be waiting, and nothing is known about the status
+    sock_events[s] = SnIR::RECV;
+  }
+  status_known = 0;
+  int_flag = 1;
+  int_pin = pin;
+
+  WiznetBus::begin();
+  Wiznet.setSocketInterruptMask((1 << MAX_SOCK_NUM) - 1,
+    SnIR::SEND_OK | SnIR::TIMEOUT | SnIR::RECV | SnIR::DISCON | SnIR::CON);
+  WiznetBus::end();
+
+  int irq = digitalPinToInterrupt(pin);
+  if (irq != NOT_AN_INTERRUPT)
+    attachInterrupt(irq, int_handler, FALLING);
+  return 1;
+}
+
+
+void socketEventsEnd()
+{
+  if (int_pin == NO_INT_PIN)
+    return;
+
+  int irq = digitalPinToInterrupt(int_pin);
+  if (irq != NOT_AN_INTERRUPT)
+    detachInterrupt(irq);
+  int_pin = NO_INT_PIN;
+
+  WiznetBus::begin();
+  Wiznet.setSocketInterruptMask(0, 0);
+  WiznetBus::end();
+}
+
+
+uint8_t socketEvents(SOCKET s)
+{
+  WiznetBus::begin();
+  uint8_t ir = pendingIR(s);
+  WiznetBus::end();
+  return ir;
+}
+
+
+void socketEventsClear(SOCKET s, uint8_t events)
+{
+  WiznetBus::begin();
+  clearIR(s, events);
+  WiznetBus::end();
+}
+
+// Command submitted on each socket, followed up by pollCommand()
+static uint8_t cmd_pending[MAX_SOCK_NUM]; // SockCMD, 0 when there is none
+static unsigned long cmd_start[MAX_SOCK_NUM];
+static uint16_t cmd_timeout[MAX_SOCK_NUM];
+
+// Bytes recv() has taken from each socket without yet moving Sn_RX_RD past
+// them. The chip counts them in Sn_RX_RSR and keeps them out of the window
+// until commitRecv().
+static uint16_t rx_unacked[MAX_SOCK_NUM];
+
+// Bytes copied into the TX buffer past Sn_TX_WR, waiting for the SEND in
+// flight to finish before they get one of their own
+static uint16_t tx_staged[MAX_SOCK_NUM];
+
+// Bytes in Sn_RX_RSR past those recv() has already taken, or -1 if the read
+// caught the register mid-update and came in under them. That still means
+// data is arriving, so callers must not take it as the buffer drained.
+static int16_t unreadSize(SOCKET s, uint16_t rsr)
+{
+  return rsr < rx_unacked[s] ? -1 : rsr - rx_unacked[s];
+}
+
+// Room in the TX buffer behind the data already staged. A torn Sn_TX_FSR read
+// can come in under tx_staged, which means no room yet. The caller holds the
+// SPI bus.
+static uint16_t stageRoom(SOCKET s)
+{
+  uint16_t fsr = Wiznet.getTXFreeSize(s);
+  return fsr < tx_staged[s] ? 0 : fsr - tx_staged[s];
+}
+
+// Hand consumed RX buffer space back to the chip. The caller holds the SPI bus.
+static void commitRecv(SOCKET s)
+{
+  if (rx_unacked[s] == 0)
+    return;
+  Wiznet.setSnRX_RD(s, Wiznet.getSnRX_RD(s) + rx_unacked[s]);
+  rx_unacked[s] = 0;
+  Wiznet.execCmdSn(s, Sock_RECV);
+}
+
+// The UDP datagram being read on each socket: where its unread payload
+// starts in the RX buffer and how much of it is left. Sn_RX_RD stays at
+// the start of the datagram until recvDatagramEnd().
+static uint16_t dgram_ptr[MAX_SOCK_NUM];
+static uint16_t dgram_left[MAX_SOCK_NUM];
+static uint8_t dgram_open; // bit per socket
+
+// The datagram being built on each socket: Sn_TX_WR and the free space as
+// they were when it was started, and how far it has been filled. Sn_TX_WR
+// itself only moves when the datagram is sent.
+static uint16_t udp_base[MAX_SOCK_NUM];
+static uint16_t udp_free[MAX_SOCK_NUM];
+static uint16_t udp_len[MAX_SOCK_NUM];
+static uint8_t udp_open; // bit per socket
+static uint8_t udp_mac; // bit per socket: sent with SEND_MAC
+
+// Cursor over the MACRAW frames queued on a socket, between the first
+// recvFrameNext() and recvFramesEnd(). MACRAW only runs on socket 0, so
+// one cursor will do.
+static uint16_t frame_base;  // Sn_RX_RD when the pass began
+static uint16_t frame_ptr;   // Start of the current frame, length field included
+static uint16_t frame_len;   // Its stored length, 0 before the first frame
+static uint16_t frame_avail; // Bytes queued from frame_ptr on
+static uint8_t frame_open;   // bit per socket
+
+// The caller holds the SPI bus
+static void submitCommand(SOCKET s, SockCMD cmd, uint16_t timeout)
+{
+  // These reset the buffer pointers, and with them anything left uncommitted
+  if (cmd == Sock_OPEN || cmd == Sock_CONNECT || cmd == Sock_LISTEN || cmd == Sock_CLOSE) {
+    rx_unacked[s] = 0;
+    tx_staged[s] = 0;
+    dgram_open &= ~(1 << s);
+    udp_open &= ~(1 << s);
+    frame_open &= ~(1 << s);
+  }
+  Wiznet.submitCmdSn(s, cmd);
+  cmd_pending[s] = cmd;
+  cmd_start[s] = millis();
+  cmd_timeout[s] = timeout;
+}
+
+// A command is done once the chip has taken it, except SEND which also has
+// to see SEND_OK come back. The caller holds the SPI bus.
+static int8_t pollCommand(SOCKET s)
 {
+  uint8_t cmd = cmd_pending[s];
+  if (cmd == 0)
+    return SOCK_CMD_DONE;
+
+  int8_t ret = SOCK_CMD_BUSY;
+  if (Wiznet.cmdSnDone(s)) {
+    if (cmd == Sock_SEND || cmd == Sock_SEND_MAC) {
+      uint8_t ir = pendingIR(s);
+      if (ir & SnIR::SEND_OK) {
+        clearIR(s, SnIR::SEND_OK);
+        ret = SOCK_CMD_DONE;
+      }
+      else if (ir & SnIR::TIMEOUT) {
+        clearIR(s, (SnIR::SEND_OK | SnIR::TIMEOUT));
+        ret = SOCK_CMD_FAILED;
+      }
+      else if (Wiznet.readSnSR(s) == SnSR::CLOSED) {
+        ret = SOCK_CMD_FAILED;
+      }
+    }
+    else {
+      ret = SOCK_CMD_DONE;
+    }
+  }
+  if (ret == SOCK_CMD_BUSY && millis() - cmd_start[s] > cmd_timeout[s])
+    ret = SOCK_CMD_TIMEOUT;
+
+  if (ret != SOCK_CMD_BUSY)
+    cmd_pending[s] = 0;
+  return ret;
+}
+
+// Copy what fits of buf in behind the data already staged. The caller holds
+// the SPI bus.
+static uint16_t stageSend(SOCKET s, const uint8_t *buf, uint16_t len)
+{
+  uint16_t room = stageRoom(s);
+  if (len > room)
+    len = room;
+  if (len > 0) {
+    Wiznet.write_data(s, Wiznet.getSnTX_WR(s) + tx_staged[s], buf, len);
+    tx_staged[s] += len;
+  }
+  return len;
+}
+
+// Give the staged data its SEND once the chip has finished with the last
+// one. Returns the outcome of the command that was in flight, or
+// SOCK_CMD_BUSY while it still is. The caller holds the SPI bus.
+static int8_t kickSend(SOCKET s, uint16_t timeout)
+{
+  int8_t ret = pollCommand(s);
+  if (ret != SOCK_CMD_BUSY && tx_staged[s]) {
+    if (ret == SOCK_CMD_DONE) {
+      Wiznet.setSnTX_WR(s, Wiznet.getSnTX_WR(s) + tx_staged[s]);
+      submitCommand(s, Sock_SEND, timeout);
+    }
+    tx_staged[s] = 0;
+  }
+  return ret;
+}
+
+// Blocking wait on pollCommand(), letting go of the bus between polls.
+// The caller holds the SPI bus.
+static int8_t waitCommand(SOCKET s)
+{
+  int8_t ret;
+  while ((ret = pollCommand(s)) == SOCK_CMD_BUSY) {
+    WiznetBus::pause();
+  }
+  return ret;
+}
+
+
+/**
+ * @brief	Report on the command last submitted to the socket.
+ * @return	SOCK_CMD_DONE, SOCK_CMD_BUSY, SOCK_CMD_TIMEOUT or SOCK_CMD_FAILED.
+ */
+int8_t socketCommandPoll(SOCKET s)
+{
+  WiznetBus::begin();
+  int8_t ret = kickSend(s, SOCKET_SEND_TIMEOUT_MS);
+  if (ret == SOCK_CMD_DONE)
+    ret = pollCommand(s); // Busy again if staged data has just been sent
+  WiznetBus::end();
+  return ret;
+}
+
+
+/**
+ * @brief	Set the socket up in the given mode and submit the OPEN command.
+ * @return	1 if the command was submitted else 0.
+ */
+uint8_t socketAsync(SOCKET s, uint8_t protocol, uint16_t port, uint8_t flag)
+{
+  // A socket left without buffer memory can't carry any traffic
+  if (Wiznet.getTXBufferSize(s) == 0 || Wiznet.getRXBufferSize(s) == 0)
+    return 0;
+
   if ((protocol == SnMR::TCP) || (protocol == SnMR::UDP) || (protocol == SnMR::IPRAW) || (protocol == SnMR::MACRAW) || (protocol == SnMR::PPPOE))
   {
     close(s);
-    SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
-    Wiznet.writeSnMR(s, protocol | flag);
+    WiznetBus::begin();
+    statusChanged(s);
+    Wiznet.setSnMR(s, protocol | flag);
     if (port != 0) {
-      Wiznet.writeSnPORT(s, port);
+      Wiznet.setSnPORT(s, port);
     } 
     else {
       local_port++; // if don't set the source port, set local_port number.
-      Wiznet.writeSnPORT(s, local_port);
+      Wiznet.setSnPORT(s, local_port);
     }
-    Wiznet.execCmdSn(s, Sock_OPEN);
-    SPI.endTransaction();
+    submitCommand(s, Sock_OPEN, WIZNET_CMD_TIMEOUT_MS);
+    WiznetBus::end();
     return 1;
   }
 
@@ -36,51 +370,153 @@ uint8_t socket(SOCKET s, uint8_t protocol, uint16_t port, uint8_t flag)
 }
 
 
+/**
+ * @brief	This Socket function initialize the channel in perticular mode, and set the port and wait for Wiznet done it.
+ * @return 	1 for success else 0.
+ */
+uint8_t socket(SOCKET s, uint8_t protocol, uint16_t port, uint8_t flag)
+{
+  if (!socketAsync(s, protocol, port, flag))
+    return 0;
+
+  WiznetBus::begin();
+  int8_t ret = waitCommand(s);
+  WiznetBus::end();
+  return ret == SOCK_CMD_DONE;
+}
+
+
 uint8_t socketStatus(SOCKET s)
 {
-  SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+  if (eventsIdle() && (status_known & (1 << s)))
+    return sock_status[s];
+
+  WiznetBus::begin();
+  serviceEvents();
   uint8_t status = Wiznet.readSnSR(s);
-  SPI.endTransaction();
+  WiznetBus::end();
+
+  if (int_pin != NO_INT_PIN && stableStatus(status)) {
+    sock_status[s] = status;
+    status_known |= (1 << s);
+  }
   return status;
 }
 
 
+/**
+ * @brief	Fill snap (MAX_SOCK_NUM entries) with the IR, status and received
+ * 		size of every socket, read in one go.
+ */
+void socketSnapshot(SocketSnapshot *snap)
+{
+  WiznetBus::begin();
+  serviceEvents();
+  if (eventsIdle()) {
+    // The caches are current, so only read what they don't cover: the status
+    // of sockets in passing states, and how much has come in where RECV is
+    // pending. Without RECV, nothing has arrived past what recv() has taken.
+    for (SOCKET s = 0; s < MAX_SOCK_NUM; s++) {
+      snap[s].ir = sock_events[s];
+      snap[s].sr = (status_known & (1 << s)) ? sock_status[s] : Wiznet.readSnSR(s);
+      snap[s].rx_rsr = (sock_events[s] & SnIR::RECV) ? Wiznet.getRXReceivedSize(s) : rx_unacked[s];
+    }
+  }
+  else {
+    Wiznet.getSocketSnapshot(snap);
+  }
+  WiznetBus::end();
+
+  uint8_t drained = 0;
+  for (SOCKET s = 0; s < MAX_SOCK_NUM; s++) {
+    int16_t unread = unreadSize(s, snap[s].rx_rsr);
+    if (unread == 0)
+      drained |= (1 << s);
+    snap[s].rx_rsr = unread > 0 ? unread : 0;
+  }
+
+  if (int_pin == NO_INT_PIN)
+    return;
+  // Events already collected were cleared on the chip, so merge them back,
+  // and let the fresh reads refresh the caches
+  for (SOCKET s = 0; s < MAX_SOCK_NUM; s++) {
+    snap[s].ir |= sock_events[s];
+    if (drained & (1 << s))
+      sock_events[s] &= ~SnIR::RECV;
+    if (stableStatus(snap[s].sr)) {
+      sock_status[s] = snap[s].sr;
+      status_known |= (1 << s);
+    }
+  }
+}
+
+
+/**
+ * @brief	Submit the CLOSE command. Whatever was in flight on the socket is dropped.
+ */
+void closeAsync(SOCKET s)
+{
+  WiznetBus::begin();
+  submitCommand(s, Sock_CLOSE, WIZNET_CMD_TIMEOUT_MS);
+  Wiznet.writeSnIR(s, 0xFF);
+  sock_events[s] = 0;
+  statusChanged(s);
+  WiznetBus::end();
+}
+
+
 /**
  * @brief	This function close the socket and parameter is "s" which represent the socket number
  */
 void close(SOCKET s)
 {
-  SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
-  Wiznet.execCmdSn(s, Sock_CLOSE);
-  Wiznet.writeSnIR(s, 0xFF);
-  SPI.endTransaction();
+  closeAsync(s);
+  WiznetBus::begin();
+  waitCommand(s);
+  WiznetBus::end();
 }
 
 
 /**
- * @brief	This function established  the connection for the channel in passive (server) mode. This function waits for the request from the peer.
- * @return	1 for success else 0.
+ * @brief	Submit the LISTEN command.
+ * @return	1 if the command was submitted else 0.
  */
-uint8_t listen(SOCKET s)
+uint8_t listenAsync(SOCKET s)
 {
-  SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+  WiznetBus::begin();
   if (Wiznet.readSnSR(s) != SnSR::INIT) {
-    SPI.endTransaction();
+    WiznetBus::end();
     return 0;
   }
-  Wiznet.execCmdSn(s, Sock_LISTEN);
-  SPI.endTransaction();
+  submitCommand(s, Sock_LISTEN, WIZNET_CMD_TIMEOUT_MS);
+  statusChanged(s);
+  WiznetBus::end();
   return 1;
 }
 
 
 /**
- * @brief	This function established  the connection for the channel in Active (client) mode. 
- * 		This function waits for the untill the connection is established.
- * 		
+ * @brief	This function established  the connection for the channel in passive (server) mode. This function waits for the request from the peer.
  * @return	1 for success else 0.
  */
-uint8_t connect(SOCKET s, uint8_t * addr, uint16_t port)
+uint8_t listen(SOCKET s)
+{
+  if (!listenAsync(s))
+    return 0;
+
+  WiznetBus::begin();
+  int8_t ret = waitCommand(s);
+  WiznetBus::end();
+  return ret == SOCK_CMD_DONE;
+}
+
+
+/**
+ * @brief	Submit the CONNECT command. The connection is up once socketStatus()
+ * 		reports ESTABLISHED.
+ * @return	1 if the command was submitted else 0.
+ */
+uint8_t connectAsync(SOCKET s, uint8_t * addr, uint16_t port)
 {
   if 
     (
@@ -91,16 +527,48 @@ uint8_t connect(SOCKET s, uint8_t * addr, uint16_t port)
     return 0;
 
   // set destination IP
-  SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+  WiznetBus::begin();
   Wiznet.writeSnDIPR(s, addr);
   Wiznet.writeSnDPORT(s, port);
-  Wiznet.execCmdSn(s, Sock_CONNECT);
-  SPI.endTransaction();
+  submitCommand(s, Sock_CONNECT, WIZNET_CMD_TIMEOUT_MS);
+  statusChanged(s);
+  WiznetBus::end();
 
   return 1;
 }
 
 
+/**
+ * @brief	This function established  the connection for the channel in Active (client) mode. 
+ * 		This function waits for the untill the connection is established.
+ * 		
+ * @return	1 for success else 0.
+ */
+uint8_t connect(SOCKET s, uint8_t * addr, uint16_t port)
+{
+  if (!connectAsync(s, addr, port))
+    return 0;
+
+  WiznetBus::begin();
+  int8_t ret = waitCommand(s);
+  WiznetBus::end();
+  return ret == SOCK_CMD_DONE;
+}
+
+
+/**
+ * @brief	Submit the DISCON command, once any staged data has had its SEND.
+ */
+void disconnectAsync(SOCKET s)
+{
+  WiznetBus::begin();
+  while (tx_staged[s] && kickSend(s, SOCKET_SEND_TIMEOUT_MS) == SOCK_CMD_BUSY)
+    WiznetBus::pause();
+  submitCommand(s, Sock_DISCON, WIZNET_CMD_TIMEOUT_MS);
+  statusChanged(s);
+  WiznetBus::end();
+}
+
 
 /**
  * @brief	This function used for disconnect the socket and parameter is "s" which represent the socket number
@@ -108,66 +576,113 @@ uint8_t connect(SOCKET s, uint8_t * addr, uint16_t port)
  */
 void disconnect(SOCKET s)
 {
-  SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
-  Wiznet.execCmdSn(s, Sock_DISCON);
-  SPI.endTransaction();
+  disconnectAsync(s);
+  WiznetBus::begin();
+  waitCommand(s);
+  WiznetBus::end();
 }
 
 
 /**
- * @brief	This function used to send the data in TCP mode
- * @return	1 for success else 0.
+ * @brief	Copy what fits of the data into the TX buffer (TCP). It goes out with
+ * 		a SEND straight away if the chip is idle, else once the SEND in flight
+ * 		completes; socketCommandPoll() moves it along and reports.
+ * @return	Number of bytes queued, 0 if there was no room or no connection. A
+ * 		SEND that failed or timed out closes the socket, and 0 is returned.
  */
-uint16_t send(SOCKET s, const uint8_t * buf, uint16_t len)
+uint16_t sendAsync(SOCKET s, const uint8_t * buf, uint16_t len, uint16_t timeout)
 {
-  uint8_t status=0;
-  uint16_t ret=0;
-  uint16_t freesize=0;
+  WiznetBus::begin();
+  uint8_t status = Wiznet.readSnSR(s);
+  if ((status != SnSR::ESTABLISHED) && (status != SnSR::CLOSE_WAIT))
+  {
+    WiznetBus::end();
+    return 0;
+  }
+  // See how the SEND in flight went before queueing behind it
+  int8_t ret = kickSend(s, timeout);
+  if (ret != SOCK_CMD_FAILED && ret != SOCK_CMD_TIMEOUT)
+  {
+    len = stageSend(s, buf, len);
+    ret = kickSend(s, timeout);
+  }
+  WiznetBus::end();
 
-  if (len > Wiznet.SSIZE) 
-    ret = Wiznet.SSIZE; // check size not to exceed MAX size.
-  else 
-    ret = len;
+  // A failed SEND means the connection is gone, so give up on it as send() does
+  if (ret == SOCK_CMD_FAILED || ret == SOCK_CMD_TIMEOUT)
+  {
+    close(s);
+    return 0;
+  }
+  return len;
+}
+
+
+/**
+ * @brief	Queue as much of the data as the TX buffer has room for, without waiting (TCP).
+ * @return	Number of bytes accepted.
+ */
+uint16_t sendNonBlocking(SOCKET s, const uint8_t * buf, uint16_t len)
+{
+  return sendAsync(s, buf, len, SOCKET_SEND_TIMEOUT_MS);
+}
 
-  // if freebuf is available, start.
-  do 
+
+/**
+ * @brief	Room left in the TX buffer, after sending anything staged if the chip is free for it.
+ */
+uint16_t sendAvailable(SOCKET s)
+{
+  WiznetBus::begin();
+  kickSend(s, SOCKET_SEND_TIMEOUT_MS);
+  uint16_t ret = stageRoom(s);
+  WiznetBus::end();
+  return ret;
+}
+
+
+/**
+ * @brief	This function used to send the data in TCP mode.
+ * 		The data is copied in while earlier segments are still going out, so
+ * 		it only waits when the TX buffer is full, and once at the end for the
+ * 		previous SEND so that the last of the data is on its way on return.
+ * @return	Number of bytes sent, 0 if the connection was lost.
+ */
+uint16_t send(SOCKET s, const uint8_t * buf, uint16_t len)
+{
+  uint16_t sent = 0;
+  int8_t ret = SOCK_CMD_DONE;
+
+  WiznetBus::begin();
+  while (sent < len || tx_staged[s])
   {
-    SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
-    freesize = Wiznet.getTXFreeSize(s);
-    status = Wiznet.readSnSR(s);
-    SPI.endTransaction();
+    uint8_t status = Wiznet.readSnSR(s);
     if ((status != SnSR::ESTABLISHED) && (status != SnSR::CLOSE_WAIT))
     {
-      ret = 0; 
+      sent = 0;
       break;
     }
-    yield();
-  }
-  while (freesize < ret);
-
-  // copy data
-  SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
-  Wiznet.send_data_processing(s, (uint8_t *)buf, ret);
-  Wiznet.execCmdSn(s, Sock_SEND);
 
-  /* +2008.01 bj */
-  while ( (Wiznet.readSnIR(s) & SnIR::SEND_OK) != SnIR::SEND_OK ) 
-  {
-    /* m2008.01 [bj] : reduce code */
-    if ( Wiznet.readSnSR(s) == SnSR::CLOSED )
+    uint16_t n = 0;
+    if (sent < len)
     {
-      SPI.endTransaction();
-      close(s);
-      return 0;
+      n = stageSend(s, buf + sent, len - sent);
+      sent += n;
     }
-    SPI.endTransaction();
-    yield();
-    SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+    ret = kickSend(s, SOCKET_SEND_TIMEOUT_MS);
+    if (ret == SOCK_CMD_FAILED || ret == SOCK_CMD_TIMEOUT)
+      break;
+    if (n == 0)
+      WiznetBus::pause(); // Full buffer, or waiting to hand over the last of it
   }
-  /* +2008.01 bj */
-  Wiznet.writeSnIR(s, SnIR::SEND_OK);
-  SPI.endTransaction();
-  return ret;
+  WiznetBus::end();
+
+  if (ret == SOCK_CMD_FAILED || ret == SOCK_CMD_TIMEOUT)
+  {
+    close(s);
+    return 0;
+  }
+  return sent;
 }
 
 
@@ -180,10 +695,16 @@ uint16_t send(SOCKET s, const uint8_t * buf, uint16_t len)
 int16_t recv(SOCKET s, uint8_t *buf, int16_t len)
 {
   // Check how much data is available
-  SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
-  int16_t ret = Wiznet.getRXReceivedSize(s);
-  if ( ret == 0 )
+  WiznetBus::begin();
+  serviceEvents();
+  int16_t ret = unreadSize(s, Wiznet.getRXReceivedSize(s));
+  if ( ret <= 0 )
   {
+    if ( ret == 0 )
+      sock_events[s] &= ~SnIR::RECV;
+    // Nothing left to read: give back what has been read so far, so the
+    // window is never held short while the application waits for more
+    commitRecv(s);
     // No data available.
     uint8_t status = Wiznet.readSnSR(s);
     if ( status == SnSR::LISTEN || status == SnSR::CLOSED || status == SnSR::CLOSE_WAIT )
@@ -204,23 +725,54 @@ int16_t recv(SOCKET s, uint8_t *buf, int16_t len)
 
   if ( ret > 0 )
   {
-    Wiznet.recv_data_processing(s, buf, ret);
-    Wiznet.execCmdSn(s, Sock_RECV);
+    Wiznet.read_data(s, Wiznet.getSnRX_RD(s) + rx_unacked[s], buf, ret);
+    rx_unacked[s] += ret;
+    if (rx_unacked[s] >= Wiznet.getRXBufferSize(s) / SOCKET_RECV_COMMIT_DIVISOR)
+      commitRecv(s);
   }
-  SPI.endTransaction();
+  WiznetBus::end();
   return ret;
 }
 
 
 int16_t recvAvailable(SOCKET s)
 {
-  SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
-  int16_t ret = Wiznet.getRXReceivedSize(s);
-  SPI.endTransaction();
+  // Keep non-blocking sends moving while the application polls for data
+  if (tx_staged[s]) {
+    WiznetBus::begin();
+    kickSend(s, SOCKET_SEND_TIMEOUT_MS);
+    WiznetBus::end();
+  }
+
+  // In interrupt mode RECV stays pending until the buffer is seen empty
+  if (eventsIdle() && !(sock_events[s] & SnIR::RECV))
+    return 0;
+
+  WiznetBus::begin();
+  serviceEvents();
+  int16_t ret = unreadSize(s, Wiznet.getRXReceivedSize(s));
+  if (ret == 0)
+    sock_events[s] &= ~SnIR::RECV;
+  if (ret <= 0) {
+    commitRecv(s);
+    ret = 0;
+  }
+  WiznetBus::end();
   return ret;
 }
 
 
+/**
+ * @brief	Hand everything recv() has consumed back to the chip now.
+ */
+void recvCommit(SOCKET s)
+{
+  WiznetBus::begin();
+  commitRecv(s);
+  WiznetBus::end();
+}
+
+
 /**
  * @brief	Returns the first byte in the receive queue (no checking)
  * 		
@@ -228,13 +780,61 @@ int16_t recvAvailable(SOCKET s)
  */
 uint16_t peek(SOCKET s, uint8_t *buf)
 {
-  SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
-  Wiznet.recv_data_processing(s, buf, 1, 1);
-  SPI.endTransaction();
+  WiznetBus::begin();
+  Wiznet.read_data(s, Wiznet.getSnRX_RD(s) + rx_unacked[s], buf, 1);
+  WiznetBus::end();
   return 1;
 }
 
 
+// Point the socket at addr:port and return the command that sends there. The caller holds the SPI bus.
+static SockCMD setDestination(SOCKET s, uint8_t *addr, uint16_t port)
+{
+  Wiznet.writeSnDIPR(s, addr);
+  Wiznet.writeSnDPORT(s, port);
+  if ((addr[0] & 0xF0) != 0xE0)
+    return Sock_SEND;
+
+  // ARP can't resolve a multicast group, so map its MAC from the group
+  // address (RFC 1112) and send with SEND_MAC
+  uint8_t mac[6] = { 0x01, 0x00, 0x5E, (uint8_t)(addr[1] & 0x7F), addr[2], addr[3] };
+  Wiznet.writeSnDHAR(s, mac);
+  return Sock_SEND_MAC;
+}
+
+
+/**
+ * @brief	Open an IP RAW socket that sends and receives the given IP protocol.
+ * @return	1 for success else 0.
+ */
+uint8_t socketRaw(SOCKET s, uint8_t protocol)
+{
+  // Sn_PROTO is only read at OPEN
+  WiznetBus::begin();
+  Wiznet.writeSnPROTO(s, protocol);
+  WiznetBus::end();
+  return socket(s, SnMR::IPRAW, 0, 0);
+}
+
+
+/**
+ * @brief	Open a UDP socket that is a member of the multicast group addr, sending
+ * 		to and receiving from port. The chip sends the IGMP join itself.
+ * @return	1 for success else 0.
+ */
+uint8_t socketMulticast(SOCKET s, uint8_t *addr, uint16_t port)
+{
+  if ((addr[0] & 0xF0) != 0xE0 || port == 0)
+    return 0;
+
+  // The group must be in place before OPEN; closing the socket leaves it be
+  WiznetBus::begin();
+  setDestination(s, addr, port);
+  WiznetBus::end();
+  return socket(s, SnMR::UDP, port, SnMR::MULTI);
+}
+
+
 /**
  * @brief	This function is an application I/F function which is used to send the data for other then TCP mode. 
  * 		Unlike TCP transmission, The peer's destination address and the port is needed.
@@ -242,16 +842,42 @@ uint16_t peek(SOCKET s, uint8_t *buf)
  * @return	This function return send data size for success else -1.
  */
 uint16_t sendto(SOCKET s, const uint8_t *buf, uint16_t len, uint8_t *addr, uint16_t port)
+{
+  WiznetBus::begin();
+  waitCommand(s);
+  uint16_t ret = sendtoAsync(s, buf, len, addr, port);
+  if (ret > 0 && waitCommand(s) != SOCK_CMD_DONE)
+    ret = 0;
+  WiznetBus::end();
+  return ret;
+}
+
+
+/**
+ * @brief	Copy the datagram into the TX buffer and submit its SEND without waiting
+ * 		(UDP or IP RAW); socketCommandPoll() reports on it.
+ * @return	Number of bytes queued, 0 if the destination is invalid or the
+ * 		socket's last command is still in progress.
+ */
+uint16_t sendtoAsync(SOCKET s, const uint8_t *buf, uint16_t len, uint8_t *addr, uint16_t port)
 {
   uint16_t ret=0;
 
-  if (len > Wiznet.SSIZE) ret = Wiznet.SSIZE; // check size not to exceed MAX size.
+  if (len > Wiznet.getTXBufferSize(s)) ret = Wiznet.getTXBufferSize(s); // check size not to exceed MAX size.
   else ret = len;
 
+  // IP RAW has no ports; only UDP needs one
+  if (port == 0x00) {
+    WiznetBus::begin();
+    if ((Wiznet.getSnMR(s) & 0x07) == SnMR::UDP)
+      ret = 0;
+    WiznetBus::end();
+  }
+
   if
     (
   ((addr[0] == 0x00) && (addr[1] == 0x00) && (addr[2] == 0x00) && (addr[3] == 0x00)) ||
-    ((port == 0x00)) ||(ret == 0)
+    (ret == 0)
     ) 
   {
     /* +2008.01 [bj] : added return value */
@@ -259,32 +885,18 @@ uint16_t sendto(SOCKET s, const uint8_t *buf, uint16_t len, uint8_t *addr, uint1
   }
   else
   {
-    SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
-    Wiznet.writeSnDIPR(s, addr);
-    Wiznet.writeSnDPORT(s, port);
-
-    // copy data
-    Wiznet.send_data_processing(s, (uint8_t *)buf, ret);
-    Wiznet.execCmdSn(s, Sock_SEND);
-
-    /* +2008.01 bj */
-    while ( (Wiznet.readSnIR(s) & SnIR::SEND_OK) != SnIR::SEND_OK ) 
-    {
-      if (Wiznet.readSnIR(s) & SnIR::TIMEOUT)
-      {
-        /* +2008.01 [bj]: clear interrupt */
-        Wiznet.writeSnIR(s, (SnIR::SEND_OK | SnIR::TIMEOUT)); /* clear SEND_OK & TIMEOUT */
-        SPI.endTransaction();
-        return 0;
-      }
-      SPI.endTransaction();
-      yield();
-      SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+    WiznetBus::begin();
+    if (pollCommand(s) == SOCK_CMD_BUSY) {
+      ret = 0;
     }
+    else {
+      SockCMD cmd = setDestination(s, addr, port);
 
-    /* +2008.01 bj */
-    Wiznet.writeSnIR(s, SnIR::SEND_OK);
-    SPI.endTransaction();
+      // copy data
+      Wiznet.send_data_processing(s, (uint8_t *)buf, ret);
+      submitCommand(s, cmd, SOCKET_SEND_TIMEOUT_MS);
+    }
+    WiznetBus::end();
   }
   return ret;
 }
@@ -293,20 +905,24 @@ uint16_t sendto(SOCKET s, const uint8_t *buf, uint16_t len, uint8_t *addr, uint1
 /**
  * @brief	This function is an application I/F function which is used to receive the data in other then
  * 	TCP mode. This function is used to receive UDP, IP_RAW and MAC_RAW mode, and handle the header as well. 
+ * 	At most len bytes are copied to buf; the rest of a longer packet is dropped.
  * 	
- * @return	This function return received data size for success else -1.
+ * @return	Number of bytes copied to buf. Pass a buffer one byte longer than the
+ * 		largest packet expected to tell a truncated one apart.
  */
 uint16_t recvfrom(SOCKET s, uint8_t *buf, uint16_t len, uint8_t *addr, uint16_t *port)
 {
   uint8_t head[8];
   uint16_t data_len=0;
+  uint16_t copy=0;
   uint16_t ptr=0;
 
   if ( len > 0 )
   {
-    SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
-    ptr = Wiznet.readSnRX_RD(s);
-    switch (Wiznet.readSnMR(s) & 0x07)
+    WiznetBus::begin();
+    commitRecv(s);
+    ptr = Wiznet.getSnRX_RD(s);
+    switch (Wiznet.getSnMR(s) & 0x07)
     {
     case SnMR::UDP :
       Wiznet.read_data(s, ptr, head, 0x08);
@@ -321,10 +937,11 @@ uint16_t recvfrom(SOCKET s, uint8_t *buf, uint16_t len, uint8_t *addr, uint16_t
       data_len = head[6];
       data_len = (data_len << 8) + head[7];
 
-      Wiznet.read_data(s, ptr, buf, data_len); // data copy.
+      copy = data_len < len ? data_len : len;
+      Wiznet.read_data(s, ptr, buf, copy); // data copy.
       ptr += data_len;
 
-      Wiznet.writeSnRX_RD(s, ptr);
+      Wiznet.setSnRX_RD(s, ptr);
       break;
 
     case SnMR::IPRAW :
@@ -338,10 +955,11 @@ uint16_t recvfrom(SOCKET s, uint8_t *buf, uint16_t len, uint8_t *addr, uint16_t
       data_len = head[4];
       data_len = (data_len << 8) + head[5];
 
-      Wiznet.read_data(s, ptr, buf, data_len); // data copy.
+      copy = data_len < len ? data_len : len;
+      Wiznet.read_data(s, ptr, buf, copy); // data copy.
       ptr += data_len;
 
-      Wiznet.writeSnRX_RD(s, ptr);
+      Wiznet.setSnRX_RD(s, ptr);
       break;
 
     case SnMR::MACRAW:
@@ -350,18 +968,255 @@ uint16_t recvfrom(SOCKET s, uint8_t *buf, uint16_t len, uint8_t *addr, uint16_t
       data_len = head[0];
       data_len = (data_len<<8) + head[1] - 2;
 
-      Wiznet.read_data(s,ptr,buf,data_len);
+      copy = data_len < len ? data_len : len;
+      Wiznet.read_data(s,ptr,buf,copy);
       ptr += data_len;
-      Wiznet.writeSnRX_RD(s, ptr);
+      Wiznet.setSnRX_RD(s, ptr);
       break;
 
     default :
       break;
     }
     Wiznet.execCmdSn(s, Sock_RECV);
-    SPI.endTransaction();
+    WiznetBus::end();
+  }
+  return copy;
+}
+
+
+/**
+ * @brief	Start reading the next UDP datagram: one read of its 8 byte header
+ * 		fills in the sender's address and port.
+ * @return	Payload length, 0 if nothing has arrived.
+ */
+uint16_t recvDatagramBegin(SOCKET s, uint8_t *addr, uint16_t *port)
+{
+  recvDatagramEnd(s);
+  if (eventsIdle() && !(sock_events[s] & SnIR::RECV))
+    return 0;
+
+  uint8_t head[8];
+  WiznetBus::begin();
+  serviceEvents();
+  commitRecv(s);
+  if (Wiznet.getRXReceivedSize(s) == 0) {
+    sock_events[s] &= ~SnIR::RECV;
+    WiznetBus::end();
+    return 0;
+  }
+  uint16_t ptr = Wiznet.getSnRX_RD(s);
+  Wiznet.read_data(s, ptr, head, 8);
+  WiznetBus::end();
+
+  memcpy(addr, head, 4);
+  *port = (head[4] << 8) | head[5];
+  dgram_ptr[s] = ptr + 8;
+  dgram_left[s] = (head[6] << 8) | head[7];
+  dgram_open |= (1 << s);
+  return dgram_left[s];
+}
+
+
+/**
+ * @brief	Copy up to len bytes of the current datagram's payload.
+ * @return	Bytes copied, 0 at the end of the datagram.
+ */
+uint16_t recvDatagramRead(SOCKET s, uint8_t *buf, uint16_t len)
+{
+  if (!(dgram_open & (1 << s)))
+    return 0;
+  if (len > dgram_left[s])
+    len = dgram_left[s];
+  if (len == 0)
+    return 0;
+
+  WiznetBus::begin();
+  Wiznet.read_data(s, dgram_ptr[s], buf, len);
+  WiznetBus::end();
+  dgram_ptr[s] += len;
+  dgram_left[s] -= len;
+  return len;
+}
+
+
+/**
+ * @brief	Next payload byte of the current datagram, without consuming it.
+ * @return	The byte, or -1 at the end of the datagram.
+ */
+int recvDatagramPeek(SOCKET s)
+{
+  if (!(dgram_open & (1 << s)) || dgram_left[s] == 0)
+    return -1;
+
+  uint8_t b;
+  WiznetBus::begin();
+  Wiznet.read_data(s, dgram_ptr[s], &b, 1);
+  WiznetBus::end();
+  return b;
+}
+
+
+/**
+ * @brief	Finish with the current datagram, skipping whatever is left of it:
+ * 		one Sn_RX_RD write and one RECV for the whole datagram.
+ */
+void recvDatagramEnd(SOCKET s)
+{
+  if (!(dgram_open & (1 << s)))
+    return;
+  dgram_open &= ~(1 << s);
+
+  WiznetBus::begin();
+  Wiznet.setSnRX_RD(s, dgram_ptr[s] + dgram_left[s]);
+  Wiznet.execCmdSn(s, Sock_RECV);
+  WiznetBus::end();
+}
+
+
+/**
+ * @brief	Copy up to max queued UDP datagrams into arena and describe each in info.
+ * 		Sn_RX_RD is written and RECV issued once for the whole batch. A
+ * 		datagram that would overrun the arena is left for the next call,
+ * 		unless it is the first, which is cut short to fit.
+ * @return	Number of datagrams taken.
+ */
+uint16_t recvDatagrams(SOCKET s, DatagramInfo *info, uint16_t max, uint8_t *arena, uint16_t arenaSize)
+{
+  recvDatagramEnd(s);
+  if (eventsIdle() && !(sock_events[s] & SnIR::RECV))
+    return 0;
+
+  uint8_t head[8];
+  uint16_t n = 0;
+  uint16_t used = 0;
+
+  WiznetBus::begin();
+  serviceEvents();
+  commitRecv(s);
+  uint16_t avail = Wiznet.getRXReceivedSize(s);
+  uint16_t ptr = Wiznet.getSnRX_RD(s);
+
+  while (n < max && avail >= 8) {
+    Wiznet.read_data(s, ptr, head, 8);
+    uint16_t len = (head[6] << 8) | head[7];
+    // Sn_RX_RSR can be read mid-update and come up short; what it doesn't
+    // yet cover waits for the next call
+    if ((uint32_t)len + 8 > avail)
+      break;
+    uint16_t copy = len;
+    if (used + len > arenaSize) {
+      if (n > 0)
+        break;
+      copy = arenaSize - used;
+    }
+
+    memcpy(info[n].addr, head, 4);
+    info[n].port = (head[4] << 8) | head[5];
+    info[n].offset = used;
+    info[n].length = copy;
+    Wiznet.read_data(s, ptr + 8, arena + used, copy);
+
+    used += copy;
+    ptr += 8 + len;
+    avail -= 8 + len;
+    n++;
+  }
+
+  if (n > 0) {
+    Wiznet.setSnRX_RD(s, ptr);
+    Wiznet.execCmdSn(s, Sock_RECV);
   }
-  return data_len;
+  if (avail == 0)
+    sock_events[s] &= ~SnIR::RECV;
+  WiznetBus::end();
+  return n;
+}
+
+
+/**
+ * @brief	Move past the current MACRAW frame, if any, to the next queued one and read
+ * 		its first headLen bytes (at least 2) into head in one burst. The
+ * 		chip stores each frame behind a 2-byte length, so the frame itself
+ * 		starts at head + 2. Nothing is released to the chip until
+ * 		recvFramesEnd().
+ * @return	Length of the frame, 0 if no more are queued.
+ */
+uint16_t recvFrameNext(SOCKET s, uint8_t *head, uint16_t headLen)
+{
+  if (!(frame_open & (1 << s))) {
+    if (eventsIdle() && !(sock_events[s] & SnIR::RECV))
+      return 0;
+    WiznetBus::begin();
+    serviceEvents();
+    commitRecv(s);
+    frame_base = frame_ptr = Wiznet.getSnRX_RD(s);
+    frame_avail = Wiznet.getRXReceivedSize(s);
+    frame_len = 0;
+    frame_open = (1 << s);
+  }
+  else {
+    WiznetBus::begin();
+  }
+
+  frame_ptr += frame_len;
+  frame_avail -= frame_len;
+  frame_len = 0;
+
+  uint16_t len = 0;
+  if (frame_avail > 2) {
+    uint16_t n = headLen < frame_avail ? headLen : frame_avail;
+    Wiznet.read_data(s, frame_ptr, head, n);
+    uint16_t stored = (head[0] << 8) | head[1];
+    if (stored > 2 && stored <= frame_avail) {
+      frame_len = stored;
+      len = stored - 2;
+    }
+  }
+  WiznetBus::end();
+  return len;
+}
+
+
+/**
+ * @brief	Copy len bytes from offset into the current MACRAW frame to buf.
+ * @return	Bytes copied.
+ */
+uint16_t recvFrameRead(SOCKET s, uint16_t offset, uint8_t *buf, uint16_t len)
+{
+  if (!(frame_open & (1 << s)) || offset + 2 >= frame_len)
+    return 0;
+  if (len > frame_len - 2 - offset)
+    len = frame_len - 2 - offset;
+
+  WiznetBus::begin();
+  Wiznet.read_data(s, frame_ptr + 2 + offset, buf, len);
+  WiznetBus::end();
+  return len;
+}
+
+
+/**
+ * @brief	Release the MACRAW frames recvFrameNext() has moved past, and the current
+ * 		one too unless keep is set, with one Sn_RX_RD write and RECV.
+ */
+void recvFramesEnd(SOCKET s, uint8_t keep)
+{
+  if (!(frame_open & (1 << s)))
+    return;
+
+  WiznetBus::begin();
+  if (!keep) {
+    frame_ptr += frame_len;
+    frame_avail -= frame_len;
+  }
+  if (frame_ptr != frame_base) {
+    Wiznet.setSnRX_RD(s, frame_ptr);
+    Wiznet.execCmdSn(s, Sock_RECV);
+  }
+  if (frame_avail == 0)
+    sock_events[s] &= ~SnIR::RECV;
+  frame_open = 0;
+  WiznetBus::end();
 }
 
 
@@ -369,52 +1224,64 @@ uint16_t igmpsend(SOCKET s, const uint8_t * buf, uint16_t len)
 {
   uint16_t ret=0;
 
-  if (len > Wiznet.SSIZE) 
-    ret = Wiznet.SSIZE; // check size not to exceed MAX size.
+  if (len > Wiznet.getTXBufferSize(s)) 
+    ret = Wiznet.getTXBufferSize(s); // check size not to exceed MAX size.
   else 
     ret = len;
 
   if (ret == 0)
     return 0;
 
-  SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+  WiznetBus::begin();
   Wiznet.send_data_processing(s, (uint8_t *)buf, ret);
-  Wiznet.execCmdSn(s, Sock_SEND);
+  submitCommand(s, Sock_SEND, SOCKET_SEND_TIMEOUT_MS);
 
-  while ( (Wiznet.readSnIR(s) & SnIR::SEND_OK) != SnIR::SEND_OK ) 
+  if (waitCommand(s) != SOCK_CMD_DONE)
   {
-    if (Wiznet.readSnIR(s) & SnIR::TIMEOUT)
-    {
-      /* in case of igmp, if send fails, then socket closed */
-      /* if you want change, remove this code. */
-      SPI.endTransaction();
-      close(s);
-      return 0;
-    }
-    SPI.endTransaction();
-    yield();
-    SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+    /* in case of igmp, if send fails, then socket closed */
+    /* if you want change, remove this code. */
+    WiznetBus::end();
+    close(s);
+    return 0;
   }
-
-  Wiznet.writeSnIR(s, SnIR::SEND_OK);
-  SPI.endTransaction();
+  WiznetBus::end();
   return ret;
 }
 
+// The caller holds the SPI bus
+static void beginDatagram(SOCKET s)
+{
+  udp_base[s] = Wiznet.getSnTX_WR(s);
+  udp_free[s] = Wiznet.getTXFreeSize(s);
+  udp_len[s] = 0;
+  udp_open |= (1 << s);
+}
+
 uint16_t bufferData(SOCKET s, uint16_t offset, const uint8_t* buf, uint16_t len)
 {
   uint16_t ret =0;
-  SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
-  if (len > Wiznet.getTXFreeSize(s))
+  WiznetBus::begin();
+  if (!(udp_open & (1 << s)))
+    beginDatagram(s);
+  if (offset >= udp_free[s])
+  {
+    ret = 0;
+  }
+  else if (len > udp_free[s] - offset)
   {
-    ret = Wiznet.getTXFreeSize(s); // check size not to exceed MAX size.
+    ret = udp_free[s] - offset; // check size not to exceed MAX size.
   }
   else
   {
     ret = len;
   }
-  Wiznet.send_data_processing_offset(s, offset, buf, ret);
-  SPI.endTransaction();
+  if (ret > 0)
+  {
+    Wiznet.write_data(s, udp_base[s] + offset, buf, ret);
+    if (offset + ret > udp_len[s])
+      udp_len[s] = offset + ret;
+  }
+  WiznetBus::end();
   return ret;
 }
 
@@ -430,39 +1297,29 @@ int startUDP(SOCKET s, uint8_t* addr, uint16_t port)
   }
   else
   {
-    SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
-    Wiznet.writeSnDIPR(s, addr);
-    Wiznet.writeSnDPORT(s, port);
-    SPI.endTransaction();
+    WiznetBus::begin();
+    if (setDestination(s, addr, port) == Sock_SEND_MAC)
+      udp_mac |= (1 << s);
+    else
+      udp_mac &= ~(1 << s);
+    beginDatagram(s);
+    WiznetBus::end();
     return 1;
   }
 }
 
 int sendUDP(SOCKET s)
 {
-  SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
-  Wiznet.execCmdSn(s, Sock_SEND);
-		
-  /* +2008.01 bj */
-  while ( (Wiznet.readSnIR(s) & SnIR::SEND_OK) != SnIR::SEND_OK ) 
-  {
-    if (Wiznet.readSnIR(s) & SnIR::TIMEOUT)
-    {
-      /* +2008.01 [bj]: clear interrupt */
-      Wiznet.writeSnIR(s, (SnIR::SEND_OK|SnIR::TIMEOUT));
-      SPI.endTransaction();
-      return 0;
-    }
-    SPI.endTransaction();
-    yield();
-    SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+  WiznetBus::begin();
+  if (udp_open & (1 << s)) {
+    Wiznet.setSnTX_WR(s, udp_base[s] + udp_len[s]);
+    udp_open &= ~(1 << s);
   }
+  submitCommand(s, (udp_mac & (1 << s)) ? Sock_SEND_MAC : Sock_SEND, SOCKET_SEND_TIMEOUT_MS);
+  int8_t ret = waitCommand(s);
+  WiznetBus::end();
 
-  /* +2008.01 bj */	
-  Wiznet.writeSnIR(s, SnIR::SEND_OK);
-  SPI.endTransaction();
-
-  /* Sent ok */
-  return 1;
+  /* Sent ok? */
+  return ret == SOCK_CMD_DONE;
 }
 
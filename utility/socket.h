@@ -5,6 +5,7 @@
 
 extern uint8_t socket(SOCKET s, uint8_t protocol, uint16_t port, uint8_t flag); // Opens a socket(TCP or UDP or IP_RAW mode)
 extern uint8_t socketStatus(SOCKET s);
+extern void socketSnapshot(SocketSnapshot *snap); // State of all MAX_SOCK_NUM sockets at once
 extern void close(SOCKET s); // Close socket
 extern uint8_t connect(SOCKET s, uint8_t * addr, uint16_t port); // Establish TCP connection (Active connection)
 extern void disconnect(SOCKET s); // disconnect the connection
@@ -12,11 +13,74 @@ extern uint8_t listen(SOCKET s);	// Establish TCP connection (Passive connection
 extern uint16_t send(SOCKET s, const uint8_t * buf, uint16_t len); // Send data (TCP)
 extern int16_t recv(SOCKET s, uint8_t * buf, int16_t len);	// Receive data (TCP)
 extern int16_t recvAvailable(SOCKET s);
+extern void recvCommit(SOCKET s); // Release the RX buffer space recv() has consumed
+
+// recv() moves Sn_RX_RD and issues RECV only once this fraction of the RX
+// buffer has been read, or when there is nothing left to read
+#ifndef SOCKET_RECV_COMMIT_DIVISOR
+#define SOCKET_RECV_COMMIT_DIVISOR 4
+#endif
 extern uint16_t peek(SOCKET s, uint8_t *buf);
 extern uint16_t sendto(SOCKET s, const uint8_t * buf, uint16_t len, uint8_t * addr, uint16_t port); // Send data (UDP/IP RAW)
 extern uint16_t recvfrom(SOCKET s, uint8_t * buf, uint16_t len, uint8_t * addr, uint16_t *port); // Receive data (UDP/IP RAW)
 
 extern uint16_t igmpsend(SOCKET s, const uint8_t * buf, uint16_t len);
+extern uint8_t socketMulticast(SOCKET s, uint8_t * addr, uint16_t port); // Opens a UDP socket joined to a multicast group
+extern uint8_t socketRaw(SOCKET s, uint8_t protocol); // Opens an IP RAW socket for one IP protocol
+
+// UDP receive, one datagram at a time. The payload is read straight from the
+// RX buffer, and the chip is told the datagram is consumed only once, by
+// recvDatagramEnd() (which the next recvDatagramBegin() calls if need be).
+extern uint16_t recvDatagramBegin(SOCKET s, uint8_t * addr, uint16_t *port); // Returns the payload length
+extern uint16_t recvDatagramRead(SOCKET s, uint8_t * buf, uint16_t len);
+extern int recvDatagramPeek(SOCKET s);
+extern void recvDatagramEnd(SOCKET s);
+// Take up to max datagrams in one pass, with a single RECV
+extern uint16_t recvDatagrams(SOCKET s, DatagramInfo *info, uint16_t max, uint8_t *arena, uint16_t arenaSize);
+
+// MACRAW receive in bulk. Step through the queued frames with recvFrameNext(),
+// which reads each one's length and leading bytes in a single burst, copy what
+// is wanted with recvFrameRead(), and release the lot with recvFramesEnd().
+extern uint16_t recvFrameNext(SOCKET s, uint8_t * head, uint16_t headLen); // Returns the frame length
+extern uint16_t recvFrameRead(SOCKET s, uint16_t offset, uint8_t * buf, uint16_t len);
+extern void recvFramesEnd(SOCKET s, uint8_t keep);
+
+// Non-blocking commands. The *Async calls submit the command and return at
+// once; socketCommandPoll() then reports on it. The blocking calls above are
+// these followed by a wait, so they cannot hang on a chip that stops answering.
+#define SOCK_CMD_DONE     1
+#define SOCK_CMD_BUSY     0
+#define SOCK_CMD_TIMEOUT -1 // Deadline passed with the command unfinished
+#define SOCK_CMD_FAILED  -2 // The chip gave up (socket closed or Sn_IR TIMEOUT)
+
+// Deadline for the blocking sends. Longer than the chip's own TCP
+// retransmission timeout with the default RTR/RCR (31.8s).
+#ifndef SOCKET_SEND_TIMEOUT_MS
+#define SOCKET_SEND_TIMEOUT_MS 40000
+#endif
+
+extern uint8_t socketAsync(SOCKET s, uint8_t protocol, uint16_t port, uint8_t flag);
+extern void closeAsync(SOCKET s);
+extern uint8_t connectAsync(SOCKET s, uint8_t * addr, uint16_t port);
+extern void disconnectAsync(SOCKET s);
+extern uint8_t listenAsync(SOCKET s);
+extern uint16_t sendAsync(SOCKET s, const uint8_t * buf, uint16_t len, uint16_t timeout); // Returns bytes queued
+extern uint16_t sendtoAsync(SOCKET s, const uint8_t * buf, uint16_t len, uint8_t * addr, uint16_t port); // Returns bytes queued
+extern int8_t socketCommandPoll(SOCKET s);
+
+// Streaming TCP send. send() copies data in while earlier segments are still
+// in flight; these never wait at all.
+extern uint16_t sendNonBlocking(SOCKET s, const uint8_t * buf, uint16_t len); // Returns bytes accepted
+extern uint16_t sendAvailable(SOCKET s); // Room in the TX buffer
+
+// Interrupt driven socket events. With INTn wired to a pin, the Sn_IR bits
+// (SnIR::CON, DISCON, RECV, TIMEOUT, SEND_OK) are read only when the chip
+// signals them, and socketStatus()/recvAvailable() answer idle sockets
+// without touching the SPI bus.
+extern uint8_t socketEventsBegin(uint8_t pin); // Returns 1 on success, else 0
+extern void socketEventsEnd();
+extern uint8_t socketEvents(SOCKET s); // Pending SnIR bits for the socket
+extern void socketEventsClear(SOCKET s, uint8_t events);
 
 // Functions to allow buffered UDP send (i.e. where the UDP datagram is built up over a
 // number of calls before being sent
@@ -38,8 +38,25 @@ W5100Class Wiznet;
 
 const uint16_t W5100Class::CH_BASE = 0x4000;
 const uint16_t W5100Class::CH_SIZE = 0x0100;
+uint16_t W5100Class::SSIZE[W5100Class::SOCKETS] = {2048,2048,2048,2048};
+uint16_t W5100Class::RSIZE[W5100Class::SOCKETS] = {2048,2048,2048,2048};
+uint16_t W5100Class::SMASK[W5100Class::SOCKETS] = {0x07FF,0x07FF,0x07FF,0x07FF};
+uint16_t W5100Class::RMASK[W5100Class::SOCKETS] = {0x07FF,0x07FF,0x07FF,0x07FF};
 uint16_t W5100Class::SBASE[W5100Class::SOCKETS] = {0,0,0,0};
 uint16_t W5100Class::RBASE[W5100Class::SOCKETS] = {0,0,0,0};
+uint16_t W5100Class::_txwr[MAX_SOCK_NUM];
+uint16_t W5100Class::_rxrd[MAX_SOCK_NUM];
+uint16_t W5100Class::_port[MAX_SOCK_NUM];
+uint8_t  W5100Class::_mr[MAX_SOCK_NUM];
+uint8_t  W5100Class::_txwrValid = 0;
+uint8_t  W5100Class::_rxrdValid = 0;
+uint8_t  W5100Class::_portValid = 0;
+uint8_t  W5100Class::_mrValid = 0;
+uint8_t  W5100Class::_gar[4];
+uint8_t  W5100Class::_subr[4];
+uint8_t  W5100Class::_shar[6];
+uint8_t  W5100Class::_sipr[4];
+uint8_t  W5100Class::_commonValid = 0;
 
 uint8_t W5100Class::init(void)
 {
@@ -56,14 +73,8 @@ uint8_t W5100Class::init(void)
 #endif
   
   writeMR(1<<RST);
-  writeTMSR(0x55);
-  writeRMSR(0x55);
-
-  for (int i=0; i<SOCKETS; i++) {
-    SBASE[i] = TXBUF_BASE + SSIZE * i;
-    RBASE[i] = RXBUF_BASE + RSIZE * i;
-  }
-  SPI.endTransaction();
+  resync();
+  writeBufferSizes();
   return 1; // successful init
 }
 
@@ -82,30 +93,281 @@ void W5100Class::reset(void)
   }
 }
 
+// Size field of TMSR/RMSR for 1, 2, 4 and 8KB
+static uint8_t memsizeCode(uint16_t size)
+{
+  switch (size) {
+  case 2048: return 1;
+  case 4096: return 2;
+  case 8192: return 3;
+  default:   return 0;
+  }
+}
+
+static uint8_t validDirection(const uint8_t *kb, int sockets, uint8_t total)
+{
+  uint16_t sum = 0;
+  for (int i=0; i<sockets; i++) {
+    if (kb[i] != 0 && kb[i] != 1 && kb[i] != 2 && kb[i] != 4 && kb[i] != 8)
+      return 0;
+    // Memory is handed out in socket order, so there is no way to skip a socket
+    if (kb[i] != 0 && i > 0 && kb[i-1] == 0)
+      return 0;
+    sum += kb[i];
+  }
+  return sum <= total;
+}
+
+uint8_t W5100Class::validBufferSizes(const uint8_t *txKB, const uint8_t *rxKB)
+{
+  return validDirection(txKB, SOCKETS, MEMORY_KB) && validDirection(rxKB, SOCKETS, MEMORY_KB);
+}
+
+void W5100Class::applyBufferSizes(const uint8_t *txKB, const uint8_t *rxKB)
+{
+  for (int i=0; i<SOCKETS; i++) {
+    SSIZE[i] = (uint16_t)txKB[i] << 10;
+    RSIZE[i] = (uint16_t)rxKB[i] << 10;
+    SMASK[i] = SSIZE[i] ? SSIZE[i] - 1 : 0;
+    RMASK[i] = RSIZE[i] ? RSIZE[i] - 1 : 0;
+  }
+}
+
+void W5100Class::writeBufferSizes()
+{
+  uint8_t tmsr = 0, rmsr = 0;
+  uint16_t sbase = TXBUF_BASE, rbase = RXBUF_BASE;
+
+  for (int i=0; i<SOCKETS; i++) {
+    tmsr |= memsizeCode(SSIZE[i]) << (2 * i);
+    rmsr |= memsizeCode(RSIZE[i]) << (2 * i);
+    SBASE[i] = sbase;
+    RBASE[i] = rbase;
+    sbase += SSIZE[i];
+    rbase += RSIZE[i];
+  }
+  writeTMSR(tmsr);
+  writeRMSR(rmsr);
+}
+
+uint8_t W5100Class::setBufferSizes(const uint8_t *txKB, const uint8_t *rxKB)
+{
+  if (!validBufferSizes(txKB, rxKB))
+    return 0;
+  applyBufferSizes(txKB, rxKB);
+  return 1;
+}
+
+uint8_t W5100Class::setSocketBufferSize(SOCKET s, uint8_t txKB, uint8_t rxKB)
+{
+  uint8_t tx[SOCKETS], rx[SOCKETS];
+
+  for (int i=0; i<SOCKETS; i++) {
+    tx[i] = SSIZE[i] >> 10;
+    rx[i] = RSIZE[i] >> 10;
+  }
+  tx[s] = txKB;
+  rx[s] = rxKB;
+  if (!validBufferSizes(tx, rx))
+    return 0;
+
+  for (int i=s; i<SOCKETS; i++) {
+    if (readSnSR(i) != SnSR::CLOSED)
+      return 0;
+  }
+
+  applyBufferSizes(tx, rx);
+  writeBufferSizes();
+  return 1;
+}
+
+void W5100Class::resync(void)
+{
+  _txwrValid = 0;
+  _rxrdValid = 0;
+  _portValid = 0;
+  _mrValid = 0;
+  _commonValid = 0;
+}
+
+uint16_t W5100Class::getSnTX_WR(SOCKET s)
+{
+  if (!(_txwrValid & (1 << s))) {
+    _txwr[s] = readSnTX_WR(s);
+    _txwrValid |= (1 << s);
+  }
+  return _txwr[s];
+}
+
+void W5100Class::setSnTX_WR(SOCKET s, uint16_t ptr)
+{
+  writeSnTX_WR(s, ptr);
+  _txwr[s] = ptr;
+  _txwrValid |= (1 << s);
+}
+
+uint16_t W5100Class::getSnRX_RD(SOCKET s)
+{
+  if (!(_rxrdValid & (1 << s))) {
+    _rxrd[s] = readSnRX_RD(s);
+    _rxrdValid |= (1 << s);
+  }
+  return _rxrd[s];
+}
+
+void W5100Class::setSnRX_RD(SOCKET s, uint16_t ptr)
+{
+  writeSnRX_RD(s, ptr);
+  _rxrd[s] = ptr;
+  _rxrdValid |= (1 << s);
+}
+
+uint8_t W5100Class::getSnMR(SOCKET s)
+{
+  if (!(_mrValid & (1 << s))) {
+    _mr[s] = readSnMR(s);
+    _mrValid |= (1 << s);
+  }
+  return _mr[s];
+}
+
+void W5100Class::setSnMR(SOCKET s, uint8_t mode)
+{
+  writeSnMR(s, mode);
+  _mr[s] = mode;
+  _mrValid |= (1 << s);
+}
+
+uint16_t W5100Class::getSnPORT(SOCKET s)
+{
+  if (!(_portValid & (1 << s))) {
+    _port[s] = readSnPORT(s);
+    _portValid |= (1 << s);
+  }
+  return _port[s];
+}
+
+void W5100Class::setSnPORT(SOCKET s, uint16_t port)
+{
+  writeSnPORT(s, port);
+  _port[s] = port;
+  _portValid |= (1 << s);
+}
+
+void W5100Class::setGatewayIp(uint8_t *_addr)
+{
+  writeGAR(_addr);
+  memcpy(_gar, _addr, sizeof(_gar));
+  _commonValid |= GAR_VALID;
+}
+
+void W5100Class::getGatewayIp(uint8_t *_addr)
+{
+  if (!(_commonValid & GAR_VALID)) {
+    readGAR(_gar);
+    _commonValid |= GAR_VALID;
+  }
+  memcpy(_addr, _gar, sizeof(_gar));
+}
+
+void W5100Class::setSubnetMask(uint8_t *_addr)
+{
+  writeSUBR(_addr);
+  memcpy(_subr, _addr, sizeof(_subr));
+  _commonValid |= SUBR_VALID;
+}
+
+void W5100Class::getSubnetMask(uint8_t *_addr)
+{
+  if (!(_commonValid & SUBR_VALID)) {
+    readSUBR(_subr);
+    _commonValid |= SUBR_VALID;
+  }
+  memcpy(_addr, _subr, sizeof(_subr));
+}
+
+void W5100Class::setMACAddress(uint8_t *_addr)
+{
+  writeSHAR(_addr);
+  memcpy(_shar, _addr, sizeof(_shar));
+  _commonValid |= SHAR_VALID;
+}
+
+void W5100Class::getMACAddress(uint8_t *_addr)
+{
+  if (!(_commonValid & SHAR_VALID)) {
+    readSHAR(_shar);
+    _commonValid |= SHAR_VALID;
+  }
+  memcpy(_addr, _shar, sizeof(_shar));
+}
+
+void W5100Class::setIPAddress(uint8_t *_addr)
+{
+  writeSIPR(_addr);
+  memcpy(_sipr, _addr, sizeof(_sipr));
+  _commonValid |= SIPR_VALID;
+}
+
+void W5100Class::getIPAddress(uint8_t *_addr)
+{
+  if (!(_commonValid & SIPR_VALID)) {
+    readSIPR(_sipr);
+    _commonValid |= SIPR_VALID;
+  }
+  memcpy(_addr, _sipr, sizeof(_sipr));
+}
+
+// Both sizes are read once, high byte first. Between the library's own
+// writes and RECV commands the chip only ever grows them, so if the chip
+// updates the register while it is being read the result is stale-low, never
+// high, and is still safe to act on. The double read that used to guard
+// against that is not needed. A value past the buffer size can't be real, so
+// it is read again.
+
 uint16_t W5100Class::getTXFreeSize(SOCKET s)
 {
-  uint16_t val=0, val1=0;
+  uint16_t val;
   do {
-    val1 = readSnTX_FSR(s);
-    if (val1 != 0)
-      val = readSnTX_FSR(s);
-  } 
-  while (val != val1);
+    val = readSnTX_FSR(s);
+  } while (val > SSIZE[s]);
   return val;
 }
 
 uint16_t W5100Class::getRXReceivedSize(SOCKET s)
 {
-  uint16_t val=0,val1=0;
+  uint16_t val;
   do {
-    val1 = readSnRX_RSR(s);
-    if (val1 != 0)
-      val = readSnRX_RSR(s);
-  } 
-  while (val != val1);
+    val = readSnRX_RSR(s);
+  } while (val > RSIZE[s]);
   return val;
 }
 
+void W5100Class::setSocketInterruptMask(uint8_t sockets, uint8_t /* events */)
+{
+  // Every Sn_IR bit interrupts on the W5100, so only the sockets are masked
+  writeIMR(sockets & ((1 << SOCKETS) - 1));
+}
+
+uint8_t W5100Class::getSocketInterrupts(void)
+{
+  return readIR() & ((1 << SOCKETS) - 1);
+}
+
+void W5100Class::getSocketSnapshot(SocketSnapshot *snap)
+{
+  uint8_t buf[2];
+  for (SOCKET s = 0; s < SOCKETS; s++) {
+    readSn(s, 0x0002, buf, 2); // Sn_IR, Sn_SR
+    snap[s].ir = buf[0];
+    snap[s].sr = buf[1];
+    readSn(s, 0x0026, buf, 2); // Sn_RX_RSR
+    snap[s].rx_rsr = (buf[0] << 8) | buf[1];
+    // A torn read of the 16-bit size; fall back to reading it again
+    if (snap[s].rx_rsr > RSIZE[s])
+      snap[s].rx_rsr = getRXReceivedSize(s);
+  }
+}
 
 void W5100Class::send_data_processing(SOCKET s, const uint8_t *data, uint16_t len)
 {
@@ -115,36 +377,41 @@ void W5100Class::send_data_processing(SOCKET s, const uint8_t *data, uint16_t le
 
 void W5100Class::send_data_processing_offset(SOCKET s, uint16_t data_offset, const uint8_t *data, uint16_t len)
 {
-  uint16_t ptr = readSnTX_WR(s);
+  uint16_t ptr = getSnTX_WR(s);
   ptr += data_offset;
-  uint16_t offset = ptr & SMASK;
+  write_data(s, ptr, data, len);
+
+  ptr += len;
+  setSnTX_WR(s, ptr);
+}
+
+void W5100Class::write_data(SOCKET s, uint16_t dst, const uint8_t *data, uint16_t len)
+{
+  uint16_t offset = dst & SMASK[s];
   uint16_t dstAddr = offset + SBASE[s];
 
-  if (offset + len > SSIZE) 
+  if (offset + len > SSIZE[s]) 
   {
     // Wrap around circular buffer
-    uint16_t size = SSIZE - offset;
+    uint16_t size = SSIZE[s] - offset;
     write(dstAddr, data, size);
     write(SBASE[s], data + size, len - size);
   } 
   else {
     write(dstAddr, data, len);
   }
-
-  ptr += len;
-  writeSnTX_WR(s, ptr);
 }
 
 
 void W5100Class::recv_data_processing(SOCKET s, uint8_t *data, uint16_t len, uint8_t peek)
 {
   uint16_t ptr;
-  ptr = readSnRX_RD(s);
+  ptr = getSnRX_RD(s);
   read_data(s, ptr, data, len);
   if (!peek)
   {
     ptr += len;
-    writeSnRX_RD(s, ptr);
+    setSnRX_RD(s, ptr);
   }
 }
 
@@ -154,12 +421,12 @@ void W5100Class::read_data(SOCKET s, uint16_t src, volatile uint8_t *dst, uint16
   uint16_t src_mask;
   uint16_t src_ptr;
 
-  src_mask = (uint16_t)src & RMASK;
+  src_mask = (uint16_t)src & RMASK[s];
   src_ptr = RBASE[s] + src_mask;
 
-  if( (src_mask + len) > RSIZE ) 
+  if( (src_mask + len) > RSIZE[s] ) 
   {
-    size = RSIZE - src_mask;
+    size = RSIZE[s] - src_mask;
     read(src_ptr, (uint8_t *)dst, size);
     dst += size;
     read(RBASE[s], (uint8_t *) dst, len - size);
@@ -169,32 +436,80 @@ void W5100Class::read_data(SOCKET s, uint16_t src, volatile uint8_t *dst, uint16
 }
 
 
+// The W5100 has no burst mode: every byte is its own 4-byte frame (opcode,
+// address high, address low, data) with chip select toggled around it.
+// The loops below keep the SPI unit busy across those frames instead of
+// waiting for each transfer to finish before preparing the next byte.
+
 #ifdef USE_SPIFIFO
 uint16_t W5100Class::write(uint16_t addr, const uint8_t *buf, uint16_t len)
 {
   uint32_t i;
 
-  for (i=0; i<len; i++) {
+  if (len == 0)
+    return 0;
+
+  // Each frame is two FIFO words. Queue frame i+1 before draining frame i,
+  // which keeps at most four words in flight.
+  SPIFIFO.write16(0xF000 | (addr >> 8), SPI_CONTINUE);
+  SPIFIFO.write16((addr << 8) | buf[0]);
+  for (i=1; i<len; i++) {
+    addr++;
     SPIFIFO.write16(0xF000 | (addr >> 8), SPI_CONTINUE);
     SPIFIFO.write16((addr << 8) | buf[i]);
-    addr++;
     SPIFIFO.read();
     SPIFIFO.read();
   }
+  SPIFIFO.read();
+  SPIFIFO.read();
   return len;
 }
+#elif defined(__AVR__)
+uint16_t W5100Class::write(uint16_t _addr, const uint8_t *_buf, uint16_t _len)
+{
+  uint8_t ah = _addr >> 8;
+  uint8_t al = _addr & 0xFF;
+
+  for (uint16_t i=0; i<_len; i++)
+  {
+    setSS();
+    SPDR = 0xF0;
+    uint8_t data = _buf[i];
+    while (!(SPSR & _BV(SPIF)))
+      ;
+    SPDR = ah;
+    while (!(SPSR & _BV(SPIF)))
+      ;
+    SPDR = al;
+    while (!(SPSR & _BV(SPIF)))
+      ;
+    SPDR = data;
+    // Step the address while the data byte shifts out
+    if (++al == 0)
+      ah++;
+    while (!(SPSR & _BV(SPIF)))
+      ;
+    resetSS();
+  }
+  (void)SPDR;
+  return _len;
+}
 #else
 uint16_t W5100Class::write(uint16_t _addr, const uint8_t *_buf, uint16_t _len)
 {
+  uint8_t frame[4];
+  frame[0] = 0xF0;
+  frame[1] = _addr >> 8;
+  frame[2] = _addr & 0xFF;
+
   for (uint16_t i=0; i<_len; i++)
   {
-    setSS();    
-    SPI.transfer(0xF0);
-    SPI.transfer(_addr >> 8);
-    SPI.transfer(_addr & 0xFF);
-    _addr++;
-    SPI.transfer(_buf[i]);
+    frame[3] = _buf[i];
+    setSS();
+    WiznetSPI::write(frame, 4);
     resetSS();
+    if (++frame[2] == 0)
+      frame[1]++;
   }
   return _len;
 }
@@ -205,48 +520,95 @@ uint16_t W5100Class::read(uint16_t addr, uint8_t *buf, uint16_t len)
 {
   uint32_t i;
 
+  if (len == 0)
+    return 0;
+
+  // Each frame is three FIFO words. Start the next frame's header before
+  // collecting this frame's data, which keeps at most three words in flight.
+  SPIFIFO.write(0x0F, SPI_CONTINUE);
+  SPIFIFO.write16(addr, SPI_CONTINUE);
+  SPIFIFO.write(0);
   for (i=0; i<len; i++) {
-    #if 1
-    SPIFIFO.write(0x0F, SPI_CONTINUE);
-    SPIFIFO.write16(addr, SPI_CONTINUE);
-    addr++;
     SPIFIFO.read();
-    SPIFIFO.write(0);
     SPIFIFO.read();
+    if (i + 1 < len) {
+      addr++;
+      SPIFIFO.write(0x0F, SPI_CONTINUE);
+      SPIFIFO.write16(addr, SPI_CONTINUE);
+    }
     buf[i] = SPIFIFO.read();
-	#endif
-    #if 0
-    // this does not work, but why?
-    SPIFIFO.write16(0x0F00 | (addr >> 8), SPI_CONTINUE);
-    SPIFIFO.write16(addr << 8);
-    addr++;
-    SPIFIFO.read();
-    buf[i] = SPIFIFO.read();
-    #endif
+    if (i + 1 < len)
+      SPIFIFO.write(0);
   }
   return len;
 }
+#elif defined(__AVR__)
+uint16_t W5100Class::read(uint16_t _addr, uint8_t *_buf, uint16_t _len)
+{
+  uint8_t ah = _addr >> 8;
+  uint8_t al = _addr & 0xFF;
+
+  for (uint16_t i=0; i<_len; i++)
+  {
+    setSS();
+    SPDR = 0x0F;
+    while (!(SPSR & _BV(SPIF)))
+      ;
+    SPDR = ah;
+    while (!(SPSR & _BV(SPIF)))
+      ;
+    SPDR = al;
+    while (!(SPSR & _BV(SPIF)))
+      ;
+    SPDR = 0;
+    // Step the address while the data byte shifts in
+    if (++al == 0)
+      ah++;
+    while (!(SPSR & _BV(SPIF)))
+      ;
+    _buf[i] = SPDR;
+    resetSS();
+  }
+  return _len;
+}
 #else
 uint16_t W5100Class::read(uint16_t _addr, uint8_t *_buf, uint16_t _len)
 {
+  uint8_t frame[4];
+
   for (uint16_t i=0; i<_len; i++)
   {
+    frame[0] = 0x0F;
+    frame[1] = _addr >> 8;
+    frame[2] = _addr & 0xFF;
+    frame[3] = 0;
     setSS();
-    SPI.transfer(0x0F);
-    SPI.transfer(_addr >> 8);
-    SPI.transfer(_addr & 0xFF);
-    _addr++;
-    _buf[i] = SPI.transfer(0);
+    SPI.transfer(frame, 4);
     resetSS();
+    _addr++;
+    _buf[i] = frame[3];
   }
   return _len;
 }
 #endif
 
-void W5100Class::execCmdSn(SOCKET s, SockCMD _cmd) {
+void W5100Class::submitCmdSn(SOCKET s, SockCMD _cmd) {
+  // The chip reinitialises the buffer pointers on these
+  if (_cmd == Sock_OPEN || _cmd == Sock_CONNECT || _cmd == Sock_LISTEN || _cmd == Sock_CLOSE) {
+    _txwrValid &= ~(1 << s);
+    _rxrdValid &= ~(1 << s);
+  }
   // Send command to socket
   writeSnCR(s, _cmd);
-  // Wait for command to complete
-  while (readSnCR(s))
-    ;
+}
+
+uint8_t W5100Class::execCmdSn(SOCKET s, SockCMD _cmd) {
+  submitCmdSn(s, _cmd);
+  // Wait for command to complete, unless the chip has stopped answering
+  unsigned long start = millis();
+  while (!cmdSnDone(s)) {
+    if (millis() - start > WIZNET_CMD_TIMEOUT_MS)
+      return 0;
+  }
+  return 1;
 }
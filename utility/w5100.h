@@ -14,6 +14,15 @@
 
 #define MAX_SOCK_NUM 4
 
+// SPI clock: the rate used until tuneSPIClock() has run, and the most it may pick.
+// W5100 is specified for 14MHz.
+#ifndef WIZNET_SPI_CLOCK
+#define WIZNET_SPI_CLOCK 14000000
+#endif
+#ifndef WIZNET_SPI_MAX_CLOCK
+#define WIZNET_SPI_MAX_CLOCK 14000000
+#endif
+
 #define IDM_OR  0x8000
 #define IDM_AR0 0x8001
 #define IDM_AR1 0x8002
@@ -32,6 +41,12 @@ public:
    * the Rx memory uper-bound of socket.
    */
   static void read_data(SOCKET s, uint16_t src, volatile uint8_t * dst, uint16_t len);
+
+  /**
+   * @brief	Copy data into the Transmit buffer at the given Tx pointer, wrapping at the
+   * end of the socket's buffer. Sn_TX_WR is left alone.
+   */
+  static void write_data(SOCKET s, uint16_t dst, const uint8_t *data, uint16_t len);
   
   /**
    * @brief	 This function is being called by send() and sendto() function also. 
@@ -62,25 +77,100 @@ public:
    */
   static void recv_data_processing(SOCKET s, uint8_t *data, uint16_t len, uint8_t peek = 0);
 
-  inline void setGatewayIp(uint8_t * addr) { writeGAR(addr); }
-  inline void getGatewayIp(uint8_t * addr) { readGAR(addr); }
+  // The address registers are shadowed in RAM, so the getters only touch
+  // the chip the first time after init() or resync()
+  static void setGatewayIp(uint8_t *_addr);
+  static void getGatewayIp(uint8_t *_addr);
 
-  inline void setSubnetMask(uint8_t * addr) { writeSUBR(addr); }
-  inline void getSubnetMask(uint8_t * addr) { readSUBR(addr); }
+  static void setSubnetMask(uint8_t *_addr);
+  static void getSubnetMask(uint8_t *_addr);
 
-  inline void setMACAddress(uint8_t * addr) { writeSHAR(addr); }
-  inline void getMACAddress(uint8_t * addr) { readSHAR(addr); }
+  static void setMACAddress(uint8_t * _addr);
+  static void getMACAddress(uint8_t * _addr);
 
-  inline void setIPAddress(uint8_t * addr) { writeSIPR(addr); }
-  inline void getIPAddress(uint8_t * addr) { readSIPR(addr); }
+  static void setIPAddress(uint8_t * _addr);
+  static void getIPAddress(uint8_t * _addr);
 
   inline void setRetransmissionTime(uint16_t timeout) { writeRTR(timeout); }
   inline void setRetransmissionCount(uint8_t retry) { writeRCR(retry); }
 
-  static void execCmdSn(SOCKET s, SockCMD _cmd);
+  /**
+   * @brief	Issue a socket command and wait for the chip to take it.
+   * 
+   * @return	1 once Sn_CR has cleared, 0 if it is still set after WIZNET_CMD_TIMEOUT_MS
+   */
+  static uint8_t execCmdSn(SOCKET s, SockCMD _cmd);
+  /**
+   * @brief	Issue a socket command and return at once; poll cmdSnDone() for completion.
+   */
+  static void submitCmdSn(SOCKET s, SockCMD _cmd);
+  static inline uint8_t cmdSnDone(SOCKET s) { return readSnCR(s) == 0; }
   
   static uint16_t getTXFreeSize(SOCKET s);
   static uint16_t getRXReceivedSize(SOCKET s);
+
+  /**
+   * @brief	Route socket events to the INTn pin.
+   * 
+   * @param sockets Bitmap of the sockets allowed to interrupt
+   * @param events  Sn_IR bits (SnIR::*) that raise the interrupt.
+   *                The W5100 has no per-socket mask and raises all of them
+   */
+  static void setSocketInterruptMask(uint8_t sockets, uint8_t events);
+  /**
+   * @brief	Bitmap of the sockets with an Sn_IR bit pending.
+   */
+  static uint8_t getSocketInterrupts(void);
+
+  /**
+   * @brief	Read Sn_IR, Sn_SR and Sn_RX_RSR of every socket into snap.
+   * 
+   * Each socket takes two short reads instead of one per register.
+   */
+  static void getSocketSnapshot(SocketSnapshot *snap);
+
+  /**
+   * @brief	Shadowed access to the socket registers that only the host writes.
+   * 
+   * Sn_TX_WR, Sn_RX_RD, Sn_MR and Sn_PORT are kept in RAM as they are written, so
+   * reading them back costs no SPI traffic. The chip reinitialises the buffer
+   * pointers on OPEN and while a TCP connection is set up, so execCmdSn() drops
+   * the pointer shadows on those commands.
+   */
+  static uint16_t getSnTX_WR(SOCKET s);
+  static void setSnTX_WR(SOCKET s, uint16_t ptr);
+  static uint16_t getSnRX_RD(SOCKET s);
+  static void setSnRX_RD(SOCKET s, uint16_t ptr);
+  static uint8_t getSnMR(SOCKET s);
+  static void setSnMR(SOCKET s, uint8_t mode);
+  static uint16_t getSnPORT(SOCKET s);
+  static void setSnPORT(SOCKET s, uint16_t port);
+
+  /**
+   * @brief	Forget every shadowed register so the next access reads the chip.
+   * 
+   * init() does this itself; call it after resetting the chip by other means.
+   */
+  static void resync(void);
+
+  /**
+   * @brief	Split the 8KB of TX and 8KB of RX buffer memory between the sockets.
+   * 
+   * Sizes are in KB, one entry per socket, and may be 0, 1, 2, 4 or 8. The chip hands
+   * out memory in socket order, so a socket with no memory can only be followed by
+   * sockets with no memory. The layout is programmed by init().
+   * @return	1 if the layout fits, else 0.
+   */
+  static uint8_t setBufferSizes(const uint8_t *txKB, const uint8_t *rxKB);
+  /**
+   * @brief	Resize the buffers of one socket.
+   * 
+   * Every socket from s upwards is moved, so they must all be closed.
+   * @return	1 for success else 0.
+   */
+  static uint8_t setSocketBufferSize(SOCKET s, uint8_t txKB, uint8_t rxKB);
+  static inline uint16_t getTXBufferSize(SOCKET s) { return SSIZE[s]; }
+  static inline uint16_t getRXBufferSize(SOCKET s) { return RSIZE[s]; }
   
 
   // W5100 Registers
@@ -220,18 +310,40 @@ public:
 private:
   static void reset(void);
 
+  // Shadow copies of host-owned registers, with one valid bit per socket
+  static uint16_t _txwr[MAX_SOCK_NUM];
+  static uint16_t _rxrd[MAX_SOCK_NUM];
+  static uint16_t _port[MAX_SOCK_NUM];
+  static uint8_t  _mr[MAX_SOCK_NUM];
+  static uint8_t  _txwrValid;
+  static uint8_t  _rxrdValid;
+  static uint8_t  _portValid;
+  static uint8_t  _mrValid;
+  static uint8_t  _gar[4];
+  static uint8_t  _subr[4];
+  static uint8_t  _shar[6];
+  static uint8_t  _sipr[4];
+  static uint8_t  _commonValid;
+  static const uint8_t GAR_VALID  = 0x01;
+  static const uint8_t SUBR_VALID = 0x02;
+  static const uint8_t SHAR_VALID = 0x04;
+  static const uint8_t SIPR_VALID = 0x08;
+
   static const uint8_t  RST = 7; // Reset BIT
 
   static const int SOCKETS = 4;
-  static const uint16_t SMASK = 0x07FF; // Tx buffer MASK
-  static const uint16_t RMASK = 0x07FF; // Rx buffer MASK
-public:
-  static const uint16_t SSIZE = 2048; // Max Tx buffer size
-private:
-  static const uint16_t RSIZE = 2048; // Max Rx buffer size
+  static const uint8_t MEMORY_KB = 8; // Buffer memory per direction
+  static uint16_t SSIZE[SOCKETS]; // Tx buffer size
+  static uint16_t RSIZE[SOCKETS]; // Rx buffer size
+  static uint16_t SMASK[SOCKETS]; // Tx buffer MASK
+  static uint16_t RMASK[SOCKETS]; // Rx buffer MASK
   static uint16_t SBASE[SOCKETS]; // Tx buffer base address
   static uint16_t RBASE[SOCKETS]; // Rx buffer base address
 
+  static uint8_t validBufferSizes(const uint8_t *txKB, const uint8_t *rxKB);
+  static void applyBufferSizes(const uint8_t *txKB, const uint8_t *rxKB);
+  static void writeBufferSizes();
+
 private:
     
 #if defined(__AVR_ATmega1280__) || defined(__AVR_ATmega2560__) || defined(__AVR_ATmega1284P__)
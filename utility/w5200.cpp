@@ -27,8 +27,25 @@ W5200Class Wiznet;
 
 const uint16_t W5200Class::CH_BASE = 0x4000;
 const uint16_t W5200Class::CH_SIZE = 0x0100;
+uint16_t W5200Class::SSIZE[W5200Class::SOCKETS] = {2048,2048,2048,2048,2048,2048,2048,2048};
+uint16_t W5200Class::RSIZE[W5200Class::SOCKETS] = {2048,2048,2048,2048,2048,2048,2048,2048};
+uint16_t W5200Class::SMASK[W5200Class::SOCKETS] = {0x07FF,0x07FF,0x07FF,0x07FF,0x07FF,0x07FF,0x07FF,0x07FF};
+uint16_t W5200Class::RMASK[W5200Class::SOCKETS] = {0x07FF,0x07FF,0x07FF,0x07FF,0x07FF,0x07FF,0x07FF,0x07FF};
 uint16_t W5200Class::SBASE[W5200Class::SOCKETS] = {0,0,0,0,0,0,0,0};
 uint16_t W5200Class::RBASE[W5200Class::SOCKETS] = {0,0,0,0,0,0,0,0};
+uint16_t W5200Class::_txwr[MAX_SOCK_NUM];
+uint16_t W5200Class::_rxrd[MAX_SOCK_NUM];
+uint16_t W5200Class::_port[MAX_SOCK_NUM];
+uint8_t  W5200Class::_mr[MAX_SOCK_NUM];
+uint8_t  W5200Class::_txwrValid = 0;
+uint8_t  W5200Class::_rxrdValid = 0;
+uint8_t  W5200Class::_portValid = 0;
+uint8_t  W5200Class::_mrValid = 0;
+uint8_t  W5200Class::_gar[4];
+uint8_t  W5200Class::_subr[4];
+uint8_t  W5200Class::_shar[6];
+uint8_t  W5200Class::_sipr[4];
+uint8_t  W5200Class::_commonValid = 0;
 
 uint8_t W5200Class::init(void)
 {
@@ -38,42 +55,277 @@ uint8_t W5200Class::init(void)
   initSS();
   
   writeMR(1<<RST);
+  resync();
+
+  // Lay the buffers out for the sizes in effect, the defaults included
+  uint8_t tx[SOCKETS], rx[SOCKETS];
+  for (int i=0; i<SOCKETS; i++) {
+    tx[i] = SSIZE[i] >> 10;
+    rx[i] = RSIZE[i] >> 10;
+  }
+  applyBufferSizes(tx, rx);
   
   for (int i=0; i<SOCKETS; i++) {
-    write((0x4000 + i * 0x100 + 0x001F), 2);
-    write((0x4000 + i * 0x100 + 0x001E), 2);
+    writeBufferSize(i);
+  }
+  return 1;
+}
+
+static uint8_t validDirection(const uint8_t *kb, int sockets, uint8_t total)
+{
+  uint16_t sum = 0;
+  for (int i=0; i<sockets; i++) {
+    if (kb[i] != 0 && kb[i] != 1 && kb[i] != 2 && kb[i] != 4 && kb[i] != 8 && kb[i] != 16)
+      return 0;
+    sum += kb[i];
+  }
+  return sum <= total;
+}
+
+uint8_t W5200Class::validBufferSizes(const uint8_t *txKB, const uint8_t *rxKB)
+{
+  return validDirection(txKB, SOCKETS, MEMORY_KB) && validDirection(rxKB, SOCKETS, MEMORY_KB);
+}
+
+void W5200Class::applyBufferSizes(const uint8_t *txKB, const uint8_t *rxKB)
+{
+  uint16_t sbase = TXBUF_BASE, rbase = RXBUF_BASE;
+
+  for (int i=0; i<SOCKETS; i++) {
+    SSIZE[i] = (uint16_t)txKB[i] << 10;
+    RSIZE[i] = (uint16_t)rxKB[i] << 10;
+    SMASK[i] = SSIZE[i] ? SSIZE[i] - 1 : 0;
+    RMASK[i] = RSIZE[i] ? RSIZE[i] - 1 : 0;
+    SBASE[i] = sbase;
+    RBASE[i] = rbase;
+    sbase += SSIZE[i];
+    rbase += RSIZE[i];
   }
+}
+
+void W5200Class::writeBufferSize(SOCKET s)
+{
+  writeSnTXMEM_SIZE(s, SSIZE[s] >> 10);
+  writeSnRXMEM_SIZE(s, RSIZE[s] >> 10);
+}
+
+uint8_t W5200Class::setBufferSizes(const uint8_t *txKB, const uint8_t *rxKB)
+{
+  if (!validBufferSizes(txKB, rxKB))
+    return 0;
+  applyBufferSizes(txKB, rxKB);
+  return 1;
+}
+
+uint8_t W5200Class::setSocketBufferSize(SOCKET s, uint8_t txKB, uint8_t rxKB)
+{
+  uint8_t tx[SOCKETS], rx[SOCKETS];
+
   for (int i=0; i<SOCKETS; i++) {
-    SBASE[i] = TXBUF_BASE + SSIZE * i;
-    RBASE[i] = RXBUF_BASE + RSIZE * i;
+    tx[i] = SSIZE[i] >> 10;
+    rx[i] = RSIZE[i] >> 10;
   }
+  tx[s] = txKB;
+  rx[s] = rxKB;
+  if (!validBufferSizes(tx, rx))
+    return 0;
+
+  for (int i=s; i<SOCKETS; i++) {
+    if (readSnSR(i) != SnSR::CLOSED)
+      return 0;
+  }
+
+  applyBufferSizes(tx, rx);
+  writeBufferSize(s);
   return 1;
 }
 
+void W5200Class::resync(void)
+{
+  _txwrValid = 0;
+  _rxrdValid = 0;
+  _portValid = 0;
+  _mrValid = 0;
+  _commonValid = 0;
+}
+
+uint16_t W5200Class::getSnTX_WR(SOCKET s)
+{
+  if (!(_txwrValid & (1 << s))) {
+    _txwr[s] = readSnTX_WR(s);
+    _txwrValid |= (1 << s);
+  }
+  return _txwr[s];
+}
+
+void W5200Class::setSnTX_WR(SOCKET s, uint16_t ptr)
+{
+  writeSnTX_WR(s, ptr);
+  _txwr[s] = ptr;
+  _txwrValid |= (1 << s);
+}
+
+uint16_t W5200Class::getSnRX_RD(SOCKET s)
+{
+  if (!(_rxrdValid & (1 << s))) {
+    _rxrd[s] = readSnRX_RD(s);
+    _rxrdValid |= (1 << s);
+  }
+  return _rxrd[s];
+}
+
+void W5200Class::setSnRX_RD(SOCKET s, uint16_t ptr)
+{
+  writeSnRX_RD(s, ptr);
+  _rxrd[s] = ptr;
+  _rxrdValid |= (1 << s);
+}
+
+uint8_t W5200Class::getSnMR(SOCKET s)
+{
+  if (!(_mrValid & (1 << s))) {
+    _mr[s] = readSnMR(s);
+    _mrValid |= (1 << s);
+  }
+  return _mr[s];
+}
+
+void W5200Class::setSnMR(SOCKET s, uint8_t mode)
+{
+  writeSnMR(s, mode);
+  _mr[s] = mode;
+  _mrValid |= (1 << s);
+}
+
+uint16_t W5200Class::getSnPORT(SOCKET s)
+{
+  if (!(_portValid & (1 << s))) {
+    _port[s] = readSnPORT(s);
+    _portValid |= (1 << s);
+  }
+  return _port[s];
+}
+
+void W5200Class::setSnPORT(SOCKET s, uint16_t port)
+{
+  writeSnPORT(s, port);
+  _port[s] = port;
+  _portValid |= (1 << s);
+}
+
+void W5200Class::setGatewayIp(uint8_t *_addr)
+{
+  writeGAR(_addr);
+  memcpy(_gar, _addr, sizeof(_gar));
+  _commonValid |= GAR_VALID;
+}
+
+void W5200Class::getGatewayIp(uint8_t *_addr)
+{
+  if (!(_commonValid & GAR_VALID)) {
+    readGAR(_gar);
+    _commonValid |= GAR_VALID;
+  }
+  memcpy(_addr, _gar, sizeof(_gar));
+}
+
+void W5200Class::setSubnetMask(uint8_t *_addr)
+{
+  writeSUBR(_addr);
+  memcpy(_subr, _addr, sizeof(_subr));
+  _commonValid |= SUBR_VALID;
+}
+
+void W5200Class::getSubnetMask(uint8_t *_addr)
+{
+  if (!(_commonValid & SUBR_VALID)) {
+    readSUBR(_subr);
+    _commonValid |= SUBR_VALID;
+  }
+  memcpy(_addr, _subr, sizeof(_subr));
+}
+
+void W5200Class::setMACAddress(uint8_t *_addr)
+{
+  writeSHAR(_addr);
+  memcpy(_shar, _addr, sizeof(_shar));
+  _commonValid |= SHAR_VALID;
+}
+
+void W5200Class::getMACAddress(uint8_t *_addr)
+{
+  if (!(_commonValid & SHAR_VALID)) {
+    readSHAR(_shar);
+    _commonValid |= SHAR_VALID;
+  }
+  memcpy(_addr, _shar, sizeof(_shar));
+}
+
+void W5200Class::setIPAddress(uint8_t *_addr)
+{
+  writeSIPR(_addr);
+  memcpy(_sipr, _addr, sizeof(_sipr));
+  _commonValid |= SIPR_VALID;
+}
+
+void W5200Class::getIPAddress(uint8_t *_addr)
+{
+  if (!(_commonValid & SIPR_VALID)) {
+    readSIPR(_sipr);
+    _commonValid |= SIPR_VALID;
+  }
+  memcpy(_addr, _sipr, sizeof(_sipr));
+}
+
+// One burst, high byte first. The chip only grows these between our own
+// writes and RECVs, so a torn read comes out low and is safe to use; only an
+// impossible value (bigger than the buffer) is read again.
+
 uint16_t W5200Class::getTXFreeSize(SOCKET s)
 {
-  uint16_t val=0, val1=0;
+  uint16_t val;
   do {
-    val1 = readSnTX_FSR(s);
-    if (val1 != 0)
-      val = readSnTX_FSR(s);
-  } 
-  while (val != val1);
+    val = readSnTX_FSR(s);
+  } while (val > SSIZE[s]);
   return val;
 }
 
 uint16_t W5200Class::getRXReceivedSize(SOCKET s)
 {
-  uint16_t val=0,val1=0;
+  uint16_t val;
   do {
-    val1 = readSnRX_RSR(s);
-    if (val1 != 0)
-      val = readSnRX_RSR(s);
-  } 
-  while (val != val1);
+    val = readSnRX_RSR(s);
+  } while (val > RSIZE[s]);
   return val;
 }
 
+void W5200Class::setSocketInterruptMask(uint8_t sockets, uint8_t events)
+{
+  for (int i=0; i<SOCKETS; i++) {
+    writeSnIMR(i, (sockets & (1 << i)) ? events : 0);
+  }
+  writeSIMR(sockets);
+}
+
+uint8_t W5200Class::getSocketInterrupts(void)
+{
+  return readIR2();
+}
+
+void W5200Class::getSocketSnapshot(SocketSnapshot *snap)
+{
+  uint8_t buf[2];
+  for (SOCKET s = 0; s < SOCKETS; s++) {
+    readSn(s, 0x0002, buf, 2); // Sn_IR, Sn_SR
+    snap[s].ir = buf[0];
+    snap[s].sr = buf[1];
+    readSn(s, 0x0026, buf, 2); // Sn_RX_RSR
+    snap[s].rx_rsr = (buf[0] << 8) | buf[1];
+    // A torn read of the 16-bit size; fall back to reading it again
+    if (snap[s].rx_rsr > RSIZE[s])
+      snap[s].rx_rsr = getRXReceivedSize(s);
+  }
+}
 
 void W5200Class::send_data_processing(SOCKET s, const uint8_t *data, uint16_t len)
 {
@@ -83,36 +335,41 @@ void W5200Class::send_data_processing(SOCKET s, const uint8_t *data, uint16_t le
 
 void W5200Class::send_data_processing_offset(SOCKET s, uint16_t data_offset, const uint8_t *data, uint16_t len)
 {
-  uint16_t ptr = readSnTX_WR(s);
+  uint16_t ptr = getSnTX_WR(s);
   ptr += data_offset;
-  uint16_t offset = ptr & SMASK;
+  write_data(s, ptr, data, len);
+
+  ptr += len;
+  setSnTX_WR(s, ptr);
+}
+
+void W5200Class::write_data(SOCKET s, uint16_t dst, const uint8_t *data, uint16_t len)
+{
+  uint16_t offset = dst & SMASK[s];
   uint16_t dstAddr = offset + SBASE[s];
 
-  if (offset + len > SSIZE) 
+  if (offset + len > SSIZE[s]) 
   {
     // Wrap around circular buffer
-    uint16_t size = SSIZE - offset;
+    uint16_t size = SSIZE[s] - offset;
     write(dstAddr, data, size);
     write(SBASE[s], data + size, len - size);
   } 
   else {
     write(dstAddr, data, len);
   }
-
-  ptr += len;
-  writeSnTX_WR(s, ptr);
 }
 
 
 void W5200Class::recv_data_processing(SOCKET s, uint8_t *data, uint16_t len, uint8_t peek)
 {
   uint16_t ptr;
-  ptr = readSnRX_RD(s);
+  ptr = getSnRX_RD(s);
   read_data(s, ptr, data, len);
   if (!peek)
   {
     ptr += len;
-    writeSnRX_RD(s, ptr);
+    setSnRX_RD(s, ptr);
   }
 }
 
@@ -122,12 +379,12 @@ void W5200Class::read_data(SOCKET s, uint16_t src, volatile uint8_t *dst, uint16
   uint16_t src_mask;
   uint16_t src_ptr;
 
-  src_mask = (uint16_t)src & RMASK;
+  src_mask = (uint16_t)src & RMASK[s];
   src_ptr = RBASE[s] + src_mask;
 
-  if( (src_mask + len) > RSIZE ) 
+  if( (src_mask + len) > RSIZE[s] ) 
   {
-    size = RSIZE - src_mask;
+    size = RSIZE[s] - src_mask;
     read(src_ptr, (uint8_t *)dst, size);
     dst += size;
     read(RBASE[s], (uint8_t *) dst, len - size);
@@ -139,45 +396,54 @@ void W5200Class::read_data(SOCKET s, uint16_t src, volatile uint8_t *dst, uint16
 
 uint16_t W5200Class::write(uint16_t _addr, const uint8_t *_buf, uint16_t _len)
 {
-    if (_len == 0) //Fix: a write request with _len == 0 hangs the W5200
-        return 0;
-        
-    setSS();
-    SPI.transfer(_addr >> 8);
-    SPI.transfer(_addr & 0xFF);
-    SPI.transfer((0x80 | ((_len & 0x7F00) >> 8)));
-    SPI.transfer(_len & 0x00FF);
-
-  for (uint16_t i=0; i<_len; i++)
-  {
-    SPI.transfer(_buf[i]);
+  if (_len == 0) //Fix: a write request with _len == 0 hangs the W5200
+    return 0;
 
-  }
-    resetSS();
+  uint8_t header[4] = {
+    (uint8_t)(_addr >> 8),
+    (uint8_t)(_addr & 0xFF),
+    (uint8_t)(0x80 | ((_len & 0x7F00) >> 8)),
+    (uint8_t)(_len & 0x00FF)
+  };
+  setSS();
+  WiznetSPI::write(header, 4);
+  WiznetSPI::write(_buf, _len);
+  resetSS();
   return _len;
 }
 
 uint16_t W5200Class::read(uint16_t _addr, uint8_t *_buf, uint16_t _len)
 {
-    setSS();
-    SPI.transfer(_addr >> 8);
-    SPI.transfer(_addr & 0xFF);
-    SPI.transfer((0x00 | ((_len & 0x7F00) >> 8)));
-    SPI.transfer(_len & 0x00FF);
-
-  for (uint16_t i=0; i<_len; i++)
-  {
-    _buf[i] = SPI.transfer(0);
-
-  }
-    resetSS();
+  uint8_t header[4] = {
+    (uint8_t)(_addr >> 8),
+    (uint8_t)(_addr & 0xFF),
+    (uint8_t)(0x00 | ((_len & 0x7F00) >> 8)),
+    (uint8_t)(_len & 0x00FF)
+  };
+  setSS();
+  WiznetSPI::write(header, 4);
+  WiznetSPI::read(_buf, _len);
+  resetSS();
   return _len;
 }
 
-void W5200Class::execCmdSn(SOCKET s, SockCMD _cmd) {
+void W5200Class::submitCmdSn(SOCKET s, SockCMD _cmd) {
+  // The chip reinitialises the buffer pointers on these
+  if (_cmd == Sock_OPEN || _cmd == Sock_CONNECT || _cmd == Sock_LISTEN || _cmd == Sock_CLOSE) {
+    _txwrValid &= ~(1 << s);
+    _rxrdValid &= ~(1 << s);
+  }
   // Send command to socket
   writeSnCR(s, _cmd);
-  // Wait for command to complete
-  while (readSnCR(s))
-    ;
+}
+
+uint8_t W5200Class::execCmdSn(SOCKET s, SockCMD _cmd) {
+  submitCmdSn(s, _cmd);
+  // Wait for command to complete, unless the chip has stopped answering
+  unsigned long start = millis();
+  while (!cmdSnDone(s)) {
+    if (millis() - start > WIZNET_CMD_TIMEOUT_MS)
+      return 0;
+  }
+  return 1;
 }
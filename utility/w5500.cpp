@@ -18,6 +18,22 @@
 W5500Class Wiznet;
 #endif
 
+uint16_t W5500Class::SSIZE[W5500Class::SOCKETS] = {2048,2048,2048,2048,2048,2048,2048,2048};
+uint16_t W5500Class::RSIZE[W5500Class::SOCKETS] = {2048,2048,2048,2048,2048,2048,2048,2048};
+uint16_t W5500Class::_txwr[MAX_SOCK_NUM];
+uint16_t W5500Class::_rxrd[MAX_SOCK_NUM];
+uint16_t W5500Class::_port[MAX_SOCK_NUM];
+uint8_t  W5500Class::_mr[MAX_SOCK_NUM];
+uint8_t  W5500Class::_txwrValid = 0;
+uint8_t  W5500Class::_rxrdValid = 0;
+uint8_t  W5500Class::_portValid = 0;
+uint8_t  W5500Class::_mrValid = 0;
+uint8_t  W5500Class::_gar[4];
+uint8_t  W5500Class::_subr[4];
+uint8_t  W5500Class::_shar[6];
+uint8_t  W5500Class::_sipr[4];
+uint8_t  W5500Class::_commonValid = 0;
+
 
 uint8_t W5500Class::init(void)
 {
@@ -25,38 +41,264 @@ uint8_t W5500Class::init(void)
     initSS();
     delay(300);
     SPI.begin();
+    resync();
+
+    for (int i=0; i<SOCKETS; i++) {
+        writeBufferSize(i);
+    }
+    return 1;
+}
+
+static uint8_t validDirection(const uint8_t *kb, int sockets, uint8_t total)
+{
+    uint16_t sum = 0;
+    for (int i=0; i<sockets; i++) {
+        if (kb[i] != 0 && kb[i] != 1 && kb[i] != 2 && kb[i] != 4 && kb[i] != 8 && kb[i] != 16)
+            return 0;
+        sum += kb[i];
+    }
+    return sum <= total;
+}
+
+uint8_t W5500Class::validBufferSizes(const uint8_t *txKB, const uint8_t *rxKB)
+{
+    return validDirection(txKB, SOCKETS, MEMORY_KB) && validDirection(rxKB, SOCKETS, MEMORY_KB);
+}
+
+void W5500Class::applyBufferSizes(const uint8_t *txKB, const uint8_t *rxKB)
+{
+    // The W5500 maps each socket's buffer itself and wraps the pointers in
+    // hardware, so only the sizes need tracking here.
+    for (int i=0; i<SOCKETS; i++) {
+        SSIZE[i] = (uint16_t)txKB[i] << 10;
+        RSIZE[i] = (uint16_t)rxKB[i] << 10;
+    }
+}
+
+void W5500Class::writeBufferSize(SOCKET s)
+{
+    writeSnTXBUF_SIZE(s, SSIZE[s] >> 10);
+    writeSnRXBUF_SIZE(s, RSIZE[s] >> 10);
+}
+
+uint8_t W5500Class::setBufferSizes(const uint8_t *txKB, const uint8_t *rxKB)
+{
+    if (!validBufferSizes(txKB, rxKB))
+        return 0;
+    applyBufferSizes(txKB, rxKB);
+    return 1;
+}
+
+uint8_t W5500Class::setSocketBufferSize(SOCKET s, uint8_t txKB, uint8_t rxKB)
+{
+    uint8_t tx[SOCKETS], rx[SOCKETS];
 
     for (int i=0; i<SOCKETS; i++) {
-        uint8_t cntl_byte = (0x0C + (i<<5));
-        write( 0x1E, cntl_byte, 2); //0x1E - Sn_RXBUF_SIZE
-        write( 0x1F, cntl_byte, 2); //0x1F - Sn_TXBUF_SIZE
+        tx[i] = SSIZE[i] >> 10;
+        rx[i] = RSIZE[i] >> 10;
+    }
+    tx[s] = txKB;
+    rx[s] = rxKB;
+    if (!validBufferSizes(tx, rx))
+        return 0;
+
+    for (int i=s; i<SOCKETS; i++) {
+        if (readSnSR(i) != SnSR::CLOSED)
+            return 0;
+    }
+
+    applyBufferSizes(tx, rx);
+    writeBufferSize(s);
+    return 1;
+}
+
+void W5500Class::resync(void)
+{
+    _txwrValid = 0;
+    _rxrdValid = 0;
+    _portValid = 0;
+    _mrValid = 0;
+    _commonValid = 0;
+}
+
+uint16_t W5500Class::getSnTX_WR(SOCKET s)
+{
+    if (!(_txwrValid & (1 << s))) {
+        _txwr[s] = readSnTX_WR(s);
+        _txwrValid |= (1 << s);
+    }
+    return _txwr[s];
+}
+
+void W5500Class::setSnTX_WR(SOCKET s, uint16_t ptr)
+{
+    writeSnTX_WR(s, ptr);
+    _txwr[s] = ptr;
+    _txwrValid |= (1 << s);
+}
+
+uint16_t W5500Class::getSnRX_RD(SOCKET s)
+{
+    if (!(_rxrdValid & (1 << s))) {
+        _rxrd[s] = readSnRX_RD(s);
+        _rxrdValid |= (1 << s);
+    }
+    return _rxrd[s];
+}
+
+void W5500Class::setSnRX_RD(SOCKET s, uint16_t ptr)
+{
+    writeSnRX_RD(s, ptr);
+    _rxrd[s] = ptr;
+    _rxrdValid |= (1 << s);
+}
+
+uint8_t W5500Class::getSnMR(SOCKET s)
+{
+    if (!(_mrValid & (1 << s))) {
+        _mr[s] = readSnMR(s);
+        _mrValid |= (1 << s);
+    }
+    return _mr[s];
+}
+
+void W5500Class::setSnMR(SOCKET s, uint8_t mode)
+{
+    writeSnMR(s, mode);
+    _mr[s] = mode;
+    _mrValid |= (1 << s);
+}
+
+uint16_t W5500Class::getSnPORT(SOCKET s)
+{
+    if (!(_portValid & (1 << s))) {
+        _port[s] = readSnPORT(s);
+        _portValid |= (1 << s);
     }
+    return _port[s];
 }
 
+void W5500Class::setSnPORT(SOCKET s, uint16_t port)
+{
+    writeSnPORT(s, port);
+    _port[s] = port;
+    _portValid |= (1 << s);
+}
+
+void W5500Class::setGatewayIp(uint8_t *_addr)
+{
+    writeGAR(_addr);
+    memcpy(_gar, _addr, sizeof(_gar));
+    _commonValid |= GAR_VALID;
+}
+
+void W5500Class::getGatewayIp(uint8_t *_addr)
+{
+    if (!(_commonValid & GAR_VALID)) {
+        readGAR(_gar);
+        _commonValid |= GAR_VALID;
+    }
+    memcpy(_addr, _gar, sizeof(_gar));
+}
+
+void W5500Class::setSubnetMask(uint8_t *_addr)
+{
+    writeSUBR(_addr);
+    memcpy(_subr, _addr, sizeof(_subr));
+    _commonValid |= SUBR_VALID;
+}
+
+void W5500Class::getSubnetMask(uint8_t *_addr)
+{
+    if (!(_commonValid & SUBR_VALID)) {
+        readSUBR(_subr);
+        _commonValid |= SUBR_VALID;
+    }
+    memcpy(_addr, _subr, sizeof(_subr));
+}
+
+void W5500Class::setMACAddress(uint8_t *_addr)
+{
+    writeSHAR(_addr);
+    memcpy(_shar, _addr, sizeof(_shar));
+    _commonValid |= SHAR_VALID;
+}
+
+void W5500Class::getMACAddress(uint8_t *_addr)
+{
+    if (!(_commonValid & SHAR_VALID)) {
+        readSHAR(_shar);
+        _commonValid |= SHAR_VALID;
+    }
+    memcpy(_addr, _shar, sizeof(_shar));
+}
+
+void W5500Class::setIPAddress(uint8_t *_addr)
+{
+    writeSIPR(_addr);
+    memcpy(_sipr, _addr, sizeof(_sipr));
+    _commonValid |= SIPR_VALID;
+}
+
+void W5500Class::getIPAddress(uint8_t *_addr)
+{
+    if (!(_commonValid & SIPR_VALID)) {
+        readSIPR(_sipr);
+        _commonValid |= SIPR_VALID;
+    }
+    memcpy(_addr, _sipr, sizeof(_sipr));
+}
+
+// Read in a single frame, MSB first: a concurrent update can only make the
+// result low, which callers cope with anyway. Values larger than the socket
+// buffer are torn the other way and get re-read.
+
 uint16_t W5500Class::getTXFreeSize(SOCKET s)
 {
-    uint16_t val=0, val1=0;
+    uint16_t val;
     do {
-        val1 = readSnTX_FSR(s);
-        if (val1 != 0)
-            val = readSnTX_FSR(s);
-    } 
-    while (val != val1);
+        val = readSnTX_FSR(s);
+    } while (val > SSIZE[s]);
     return val;
 }
 
 uint16_t W5500Class::getRXReceivedSize(SOCKET s)
 {
-    uint16_t val=0,val1=0;
+    uint16_t val;
     do {
-        val1 = readSnRX_RSR(s);
-        if (val1 != 0)
-            val = readSnRX_RSR(s);
-    } 
-    while (val != val1);
+        val = readSnRX_RSR(s);
+    } while (val > RSIZE[s]);
     return val;
 }
 
+void W5500Class::setSocketInterruptMask(uint8_t sockets, uint8_t events)
+{
+    for (int i=0; i<SOCKETS; i++) {
+        writeSnIMR(i, (sockets & (1 << i)) ? events : 0);
+    }
+    writeSIMR(sockets);
+}
+
+uint8_t W5500Class::getSocketInterrupts(void)
+{
+    return readSIR();
+}
+
+void W5500Class::getSocketSnapshot(SocketSnapshot *snap)
+{
+    uint8_t buf[2];
+    for (SOCKET s = 0; s < SOCKETS; s++) {
+        readSn(s, 0x0002, buf, 2); // Sn_IR, Sn_SR
+        snap[s].ir = buf[0];
+        snap[s].sr = buf[1];
+        readSn(s, 0x0026, buf, 2); // Sn_RX_RSR
+        snap[s].rx_rsr = (buf[0] << 8) | buf[1];
+        // A torn read of the 16-bit size; fall back to reading it again
+        if (snap[s].rx_rsr > RSIZE[s])
+            snap[s].rx_rsr = getRXReceivedSize(s);
+    }
+}
+
 void W5500Class::send_data_processing(SOCKET s, const uint8_t *data, uint16_t len)
 {
   // This is same as having no offset in a call to send_data_processing_offset
@@ -67,25 +309,30 @@ void W5500Class::send_data_processing(SOCKET s, const uint8_t *data, uint16_t le
 void W5500Class::send_data_processing_offset(SOCKET s, uint16_t data_offset, const uint8_t *data, uint16_t len)
 {
 
-    uint16_t ptr = readSnTX_WR(s);
-    uint8_t cntl_byte = (0x14+(s<<5));
+    uint16_t ptr = getSnTX_WR(s);
     ptr += data_offset;
-    write(ptr, cntl_byte, data, len);
+    write_data(s, ptr, data, len);
     ptr += len;
-    writeSnTX_WR(s, ptr);
+    setSnTX_WR(s, ptr);
     
 }
 
+void W5500Class::write_data(SOCKET s, uint16_t dst, const uint8_t *data, uint16_t len)
+{
+    uint8_t cntl_byte = (0x14+(s<<5));
+    write(dst, cntl_byte, data, len);
+}
+
 void W5500Class::recv_data_processing(SOCKET s, uint8_t *data, uint16_t len, uint8_t peek)
 {
     uint16_t ptr;
-    ptr = readSnRX_RD(s);
+    ptr = getSnRX_RD(s);
 
     read_data(s, ptr, data, len);
     if (!peek)
     {
         ptr += len;
-        writeSnRX_RD(s, ptr);
+        setSnRX_RD(s, ptr);
     }
 }
 
@@ -97,57 +344,61 @@ void W5500Class::read_data(SOCKET s, uint16_t src, volatile uint8_t *dst, uint16
 
 uint8_t W5500Class::write(uint16_t _addr, uint8_t _cb, uint8_t _data)
 {
-    setSS();  
-    SPI.transfer(_addr >> 8);
-    SPI.transfer(_addr & 0xFF);
-    SPI.transfer(_cb);
-    SPI.transfer(_data);
+    uint8_t frame[4] = { (uint8_t)(_addr >> 8), (uint8_t)(_addr & 0xFF), _cb, _data };
+    setSS();
+    WiznetSPI::write(frame, 4);
     resetSS();
     return 1;
 }
 
 uint16_t W5500Class::write(uint16_t _addr, uint8_t _cb, const uint8_t *_buf, uint16_t _len)
 {
+    uint8_t header[3] = { (uint8_t)(_addr >> 8), (uint8_t)(_addr & 0xFF), _cb };
     setSS();
-    SPI.transfer(_addr >> 8);
-    SPI.transfer(_addr & 0xFF);
-    SPI.transfer(_cb);
-    for (uint16_t i=0; i<_len; i++){
-        SPI.transfer(_buf[i]);
-    }
+    WiznetSPI::write(header, 3);
+    WiznetSPI::write(_buf, _len);
     resetSS();
     return _len;
 }
 
 uint8_t W5500Class::read(uint16_t _addr, uint8_t _cb)
 {
+    uint8_t header[3] = { (uint8_t)(_addr >> 8), (uint8_t)(_addr & 0xFF), _cb };
+    uint8_t _data;
     setSS();
-    SPI.transfer(_addr >> 8);
-    SPI.transfer(_addr & 0xFF);
-    SPI.transfer(_cb);
-    uint8_t _data = SPI.transfer(0);
+    WiznetSPI::write(header, 3);
+    WiznetSPI::read(&_data, 1);
     resetSS();
     return _data;
 }
 
 uint16_t W5500Class::read(uint16_t _addr, uint8_t _cb, uint8_t *_buf, uint16_t _len)
-{ 
+{
+    uint8_t header[3] = { (uint8_t)(_addr >> 8), (uint8_t)(_addr & 0xFF), _cb };
     setSS();
-    SPI.transfer(_addr >> 8);
-    SPI.transfer(_addr & 0xFF);
-    SPI.transfer(_cb);
-    for (uint16_t i=0; i<_len; i++){
-        _buf[i] = SPI.transfer(0);
-    }
+    WiznetSPI::write(header, 3);
+    WiznetSPI::read(_buf, _len);
     resetSS();
-   
     return _len;
 }
 
-void W5500Class::execCmdSn(SOCKET s, SockCMD _cmd) {
+void W5500Class::submitCmdSn(SOCKET s, SockCMD _cmd) {
+    // The chip reinitialises the buffer pointers on these
+    if (_cmd == Sock_OPEN || _cmd == Sock_CONNECT || _cmd == Sock_LISTEN || _cmd == Sock_CLOSE) {
+        _txwrValid &= ~(1 << s);
+        _rxrdValid &= ~(1 << s);
+    }
     // Send command to socket
     writeSnCR(s, _cmd);
-    // Wait for command to complete
-    while (readSnCR(s))
-    ;
+}
+
+uint8_t W5500Class::execCmdSn(SOCKET s, SockCMD _cmd) {
+    submitCmdSn(s, _cmd);
+    // Wait for command to complete, unless the chip has stopped answering
+    unsigned long start = millis();
+    while (!cmdSnDone(s)) {
+        if (millis() - start > WIZNET_CMD_TIMEOUT_MS)
+            return 0;
+    }
+    return 1;
 }
@@ -14,6 +14,15 @@
  
 #define MAX_SOCK_NUM 8
 
+// SPI clock: the rate used until tuneSPIClock() has run, and the most it may pick.
+// Guaranteed up to 33.3MHz, rated up to 80MHz.
+#ifndef WIZNET_SPI_CLOCK
+#define WIZNET_SPI_CLOCK 33000000
+#endif
+#ifndef WIZNET_SPI_MAX_CLOCK
+#define WIZNET_SPI_MAX_CLOCK 80000000
+#endif
+
 class W5500Class {
 
 public:
@@ -27,6 +36,12 @@ public:
    * the Rx memory uper-bound of socket.
    */
   static void read_data(SOCKET s, uint16_t src, volatile uint8_t * dst, uint16_t len);
+
+  /**
+   * @brief	Copy data into the Transmit buffer at the given Tx pointer. The chip
+   * wraps the address within the socket's buffer; Sn_TX_WR is left alone.
+   */
+  static void write_data(SOCKET s, uint16_t dst, const uint8_t *data, uint16_t len);
   
   /**
    * @brief	 This function is being called by send() and sendto() function also. 
@@ -57,25 +72,100 @@ public:
    */
   void recv_data_processing(SOCKET s, uint8_t *data, uint16_t len, uint8_t peek = 0);
 
-  inline void setGatewayIp(uint8_t *_addr) { writeGAR(_addr); }
-  inline void getGatewayIp(uint8_t *_addr) {  readGAR(_addr); }
+  // The address registers are shadowed in RAM, so the getters only touch
+  // the chip the first time after init() or resync()
+  static void setGatewayIp(uint8_t *_addr);
+  static void getGatewayIp(uint8_t *_addr);
 
-  inline void setSubnetMask(uint8_t *_addr) { writeSUBR(_addr); }
-  inline void getSubnetMask(uint8_t *_addr) {  readSUBR(_addr); }
+  static void setSubnetMask(uint8_t *_addr);
+  static void getSubnetMask(uint8_t *_addr);
 
-  inline void setMACAddress(uint8_t * _addr) { writeSHAR(_addr); }
-  inline void getMACAddress(uint8_t * _addr) {  readSHAR(_addr); }
+  static void setMACAddress(uint8_t * _addr);
+  static void getMACAddress(uint8_t * _addr);
 
-  inline void setIPAddress(uint8_t * _addr) {  writeSIPR(_addr); }
-  inline void getIPAddress(uint8_t * _addr) {  readSIPR(_addr); }
+  static void setIPAddress(uint8_t * _addr);
+  static void getIPAddress(uint8_t * _addr);
 
   inline void setRetransmissionTime(uint16_t _timeout) { writeRTR(_timeout); }
   inline void setRetransmissionCount(uint8_t _retry) { writeRCR(_retry); }
 
-  static void execCmdSn(SOCKET s, SockCMD _cmd);
+  /**
+   * @brief	Issue a socket command and wait for the chip to take it.
+   * 
+   * @return	1 once Sn_CR has cleared, 0 if it is still set after WIZNET_CMD_TIMEOUT_MS
+   */
+  static uint8_t execCmdSn(SOCKET s, SockCMD _cmd);
+  /**
+   * @brief	Issue a socket command and return at once; poll cmdSnDone() for completion.
+   */
+  static void submitCmdSn(SOCKET s, SockCMD _cmd);
+  static inline uint8_t cmdSnDone(SOCKET s) { return readSnCR(s) == 0; }
   
   static uint16_t getTXFreeSize(SOCKET s);
   static uint16_t getRXReceivedSize(SOCKET s);
+
+  /**
+   * @brief	Route socket events to the INTn pin.
+   * 
+   * @param sockets Bitmap of the sockets allowed to interrupt
+   * @param events  Sn_IR bits (SnIR::*) that raise the interrupt
+   */
+  static void setSocketInterruptMask(uint8_t sockets, uint8_t events);
+  /**
+   * @brief	Bitmap of the sockets with an Sn_IR bit pending.
+   */
+  static uint8_t getSocketInterrupts(void);
+
+  /**
+   * @brief	Read Sn_IR, Sn_SR and Sn_RX_RSR of every socket into snap.
+   * 
+   * Each socket has its own register block on this chip, so the registers are
+   * read as two bursts per socket.
+   */
+  static void getSocketSnapshot(SocketSnapshot *snap);
+
+  /**
+   * @brief	Shadowed access to the socket registers that only the host writes.
+   * 
+   * Sn_TX_WR, Sn_RX_RD, Sn_MR and Sn_PORT are kept in RAM as they are written, so
+   * reading them back costs no SPI traffic. The chip reinitialises the buffer
+   * pointers on OPEN and while a TCP connection is set up, so execCmdSn() drops
+   * the pointer shadows on those commands.
+   */
+  static uint16_t getSnTX_WR(SOCKET s);
+  static void setSnTX_WR(SOCKET s, uint16_t ptr);
+  static uint16_t getSnRX_RD(SOCKET s);
+  static void setSnRX_RD(SOCKET s, uint16_t ptr);
+  static uint8_t getSnMR(SOCKET s);
+  static void setSnMR(SOCKET s, uint8_t mode);
+  static uint16_t getSnPORT(SOCKET s);
+  static void setSnPORT(SOCKET s, uint16_t port);
+
+  /**
+   * @brief	Forget every shadowed register so the next access reads the chip.
+   * 
+   * init() does this itself; call it after resetting the chip by other means.
+   */
+  static void resync(void);
+
+  /**
+   * @brief	Split the 16KB of TX and 16KB of RX buffer memory between the sockets.
+   * 
+   * Sizes are in KB, one entry per socket, and may be 0, 1, 2, 4, 8 or 16.
+   * A socket with 0KB cannot be used. The layout is programmed by init().
+   * @return	1 if the layout fits, else 0.
+   */
+  static uint8_t setBufferSizes(const uint8_t *txKB, const uint8_t *rxKB);
+  /**
+   * @brief	Resize the buffers of one socket.
+   * 
+   * The chip lays the buffers out in socket order, so every socket from s upwards
+   * is moved and they must all be closed.
+   * @return	1 for success else 0.
+   */
+  static uint8_t setSocketBufferSize(SOCKET s, uint8_t txKB, uint8_t rxKB);
+  static inline uint16_t getTXBufferSize(SOCKET s) { return SSIZE[s]; }
+  static inline uint16_t getRXBufferSize(SOCKET s) { return RSIZE[s]; }
   
 
   // W5500 Registers
@@ -121,6 +211,8 @@ public:
   __GP_REGISTER_N(SIPR,   0x000F, 4); // Source IP address
   __GP_REGISTER8 (IR,     0x0015);    // Interrupt
   __GP_REGISTER8 (IMR,    0x0016);    // Interrupt Mask
+  __GP_REGISTER8 (SIR,    0x0017);    // Socket Interrupt
+  __GP_REGISTER8 (SIMR,   0x0018);    // Socket Interrupt Mask
   __GP_REGISTER16(RTR,    0x0019);    // Timeout address
   __GP_REGISTER8 (RCR,    0x001B);    // Retry count
   __GP_REGISTER_N(UIPR,   0x0028, 4); // Unreachable IP address in UDP mode
@@ -146,8 +238,8 @@ private:
     return read(_addr, cntl_byte, _buf, _len );
   }
   static inline uint16_t writeSn(SOCKET _s, uint16_t _addr, uint8_t *_buf, uint16_t _len) {
-    uint8_t cntl_byte = (_s<<5)+0x08;
-    return read(_addr, cntl_byte, _buf, _len );
+    uint8_t cntl_byte = (_s<<5)+0x0C;
+    return write(_addr, cntl_byte, _buf, _len );
   }
 
 
@@ -192,12 +284,15 @@ public:
   __SOCKET_REGISTER8(SnPROTO,     0x0014)        // Protocol in IP RAW Mode
   __SOCKET_REGISTER8(SnTOS,       0x0015)        // IP TOS
   __SOCKET_REGISTER8(SnTTL,       0x0016)        // IP TTL
+  __SOCKET_REGISTER8(SnRXBUF_SIZE, 0x001E)       // RX Buffer Size
+  __SOCKET_REGISTER8(SnTXBUF_SIZE, 0x001F)       // TX Buffer Size
   __SOCKET_REGISTER16(SnTX_FSR,   0x0020)        // TX Free Size
   __SOCKET_REGISTER16(SnTX_RD,    0x0022)        // TX Read Pointer
   __SOCKET_REGISTER16(SnTX_WR,    0x0024)        // TX Write Pointer
   __SOCKET_REGISTER16(SnRX_RSR,   0x0026)        // RX Free Size
   __SOCKET_REGISTER16(SnRX_RD,    0x0028)        // RX Read Pointer
   __SOCKET_REGISTER16(SnRX_WR,    0x002A)        // RX Write Pointer (supported?)
+  __SOCKET_REGISTER8(SnIMR,       0x002C)        // Interrupt Mask
   
 #undef __SOCKET_REGISTER8
 #undef __SOCKET_REGISTER16
@@ -207,13 +302,34 @@ public:
 private:
   static void reset(void);
 
+  // Shadow copies of host-owned registers, with one valid bit per socket
+  static uint16_t _txwr[MAX_SOCK_NUM];
+  static uint16_t _rxrd[MAX_SOCK_NUM];
+  static uint16_t _port[MAX_SOCK_NUM];
+  static uint8_t  _mr[MAX_SOCK_NUM];
+  static uint8_t  _txwrValid;
+  static uint8_t  _rxrdValid;
+  static uint8_t  _portValid;
+  static uint8_t  _mrValid;
+  static uint8_t  _gar[4];
+  static uint8_t  _subr[4];
+  static uint8_t  _shar[6];
+  static uint8_t  _sipr[4];
+  static uint8_t  _commonValid;
+  static const uint8_t GAR_VALID  = 0x01;
+  static const uint8_t SUBR_VALID = 0x02;
+  static const uint8_t SHAR_VALID = 0x04;
+  static const uint8_t SIPR_VALID = 0x08;
+
   static const uint8_t  RST = 7; // Reset BIT
   static const int SOCKETS = 8;
+  static const uint8_t MEMORY_KB = 16; // Buffer memory per direction
+  static uint16_t SSIZE[SOCKETS]; // Tx buffer size
+  static uint16_t RSIZE[SOCKETS]; // Rx buffer size
 
-public:
-  static const uint16_t SSIZE = 2048; // Max Tx buffer size
-private:
-  static const uint16_t RSIZE = 2048; // Max Rx buffer size
+  static uint8_t validBufferSizes(const uint8_t *txKB, const uint8_t *rxKB);
+  static void applyBufferSizes(const uint8_t *txKB, const uint8_t *rxKB);
+  static void writeBufferSize(SOCKET s);
 
 private:
 #if defined(__AVR_ATmega1280__) || defined(__AVR_ATmega2560__) || defined(__AVR_ATmega1284P__)